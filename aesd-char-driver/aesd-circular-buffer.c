@@ -16,6 +16,9 @@
 
 #include "aesd-circular-buffer.h"
 
+/* Entry count up to which find walks entry_end in order rather than binary searching it */
+#define AESD_CIRCULAR_BUFFER_LINEAR_SCAN 16
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -29,26 +32,52 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    uint8_t index = 0;
-    struct aesd_buffer_entry *entry;
+    uint32_t count, low, half, index;
+    uint64_t target;
 
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index)
-    {
-        entry = (index+buffer->out_offs >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) ? \
-                &((buffer)->entry[index+buffer->out_offs-AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]) \
-                : &((buffer)->entry[index+buffer->out_offs]);
+    if(char_offset >= buffer->size)
+        return NULL;
+
+    count = buffer->full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED :
+            (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs) %
+            AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 
-        if(char_offset >= entry->size)
+    /*
+     * entry_end only grows from the oldest entry to the newest, so look for the first one past
+     * target.  A short buffer is cheapest to walk in order, a long one is binary searched without
+     * a data dependent branch to mispredict.
+     */
+    target = buffer->total - buffer->size + char_offset;
+    low = 0;
+    if(count <= AESD_CIRCULAR_BUFFER_LINEAR_SCAN)
+    {
+        index = buffer->out_offs;
+        while(buffer->entry_end[index] <= target)
+        {
+            index = AESD_CIRCULAR_BUFFER_NEXT(index);
+            low++;
+        }
+    }
+    else
+    {
+        while(count > 1)
         {
-            char_offset -= entry->size;
-            continue;
+            half = count / 2;
+            index = buffer->out_offs + low + half - 1;
+            if(index >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+                index -= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+            low += (buffer->entry_end[index] <= target) ? half : 0;
+            count -= half;
         }
-  
-        *entry_offset_byte_rtn = char_offset;
-        return entry;
     }
 
-    return NULL;
+    index = buffer->out_offs + low;
+    if(index >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        index -= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+    *entry_offset_byte_rtn = target - (buffer->entry_end[index] - buffer->entry[index].size);
+    return &buffer->entry[index];
 }
 
 /**
@@ -63,12 +92,14 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     if(buffer->full)
     {
         buffer->size -= buffer->entry[buffer->in_offs].size;
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->out_offs = AESD_CIRCULAR_BUFFER_NEXT(buffer->out_offs);
     }
 
     buffer->entry[buffer->in_offs] = *add_entry;
     buffer->size += add_entry->size;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->total += add_entry->size;
+    buffer->entry_end[buffer->in_offs] = buffer->total;
+    buffer->in_offs = AESD_CIRCULAR_BUFFER_NEXT(buffer->in_offs);
 
     if(!buffer->full)
         buffer->full = (buffer->in_offs == buffer->out_offs) ? true : false;
@@ -76,6 +107,27 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     return;
 }
 
+/**
+* Removes the oldest entry from @param buffer, copying it to @param removed_entry so the caller
+* can release any memory it references.
+* Any necessary locking must be handled by the caller
+* @return false if the buffer was empty and nothing was removed
+*/
+bool aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_entry)
+{
+    if(!buffer->full && buffer->in_offs == buffer->out_offs)
+        return false;
+
+    *removed_entry = buffer->entry[buffer->out_offs];
+    memset(&buffer->entry[buffer->out_offs], 0, sizeof(struct aesd_buffer_entry));
+
+    buffer->size -= removed_entry->size;
+    buffer->out_offs = AESD_CIRCULAR_BUFFER_NEXT(buffer->out_offs);
+    buffer->full = false;
+
+    return true;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
 */
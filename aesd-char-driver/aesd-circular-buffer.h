@@ -16,7 +16,10 @@
 #include <stdbool.h>
 #endif
 
+// May be overridden at build time by user space users of the buffer, the driver always uses 10
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
@@ -28,37 +31,69 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Sequence number assigned by the writer when the entry was committed
+     */
+    uint64_t seq;
+    /**
+     * Commit time in nanoseconds since the epoch
+     */
+    uint64_t timestamp_ns;
 };
 
 struct aesd_circular_buffer
 {
-    /**
-     * An array of pointers to memory allocated for the most recent write operations
+    /*
+     * Fields touched by every add and lookup come first so they share a cache line.
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
-
-
+    /**
+     * Number of bytes stored in all entries
+     */
     size_t size;
+    /**
+     * Number of bytes ever added to the buffer.  The oldest stored byte is at total - size.
+     */
+    uint64_t total;
+    /**
+     * Value of total just after each entry was added, kept apart from entry so offset
+     * lookups scan one contiguous array instead of every entry
+     */
+    uint64_t entry_end[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /**
+     * An array of pointers to memory allocated for the most recent write operations
+     */
+    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
 };
 
+/**
+ * Advance an index into the entry array by one, wrapping at the end.  A power of two
+ * capacity turns the wrap into a mask.
+ */
+#define AESD_CIRCULAR_BUFFER_NEXT(index) \
+    (((AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED & (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1)) == 0) ? \
+        (((index) + 1) & (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1)) : \
+        (((index) + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED))
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern bool aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_entry);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 /**
@@ -66,7 +101,8 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is an unsigned stack allocated value used by this macro for an index, it must be
+ *      able to hold AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
  * Example usage:
  * uint8_t index;
  * struct aesd_circular_buffer buffer;
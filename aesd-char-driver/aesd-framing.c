@@ -0,0 +1,202 @@
+/**
+ * @file aesd-framing.c
+ * @brief Newline packet framing shared by the aesdchar driver and aesdsocket
+ *
+ * In the kernel this relies on the architecture's memchr, vector registers are off limits
+ * there.  In user space on x86 the delimiter is compared a vector at a time and every
+ * newline in the vector is taken from one movemask, AVX2 when the CPU has it and SSE2
+ * otherwise.
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__SSE2__) && defined(__GNUC__)
+#define AESD_FRAMING_X86 1
+#include <immintrin.h>
+#endif
+#endif
+#endif
+
+#include "aesd-framing.h"
+
+/**
+ * Finds the delimiters in @param buf one memchr call at a time, appending them to ends
+ * after @param found existing offsets.  @return the new number of offsets in ends.
+ */
+static size_t aesd_framing_find_memchr(const char *buf, size_t size, size_t *ends, size_t found,
+            size_t max_ends)
+{
+    const char *start = buf;
+    const char *end = buf + size;
+    const char *delimiter;
+
+    while(found < max_ends && start < end &&
+            (delimiter = memchr(start, AESD_FRAMING_DELIMITER, end - start)) != NULL)
+    {
+        ends[found++] = delimiter + 1 - buf;
+        start = delimiter + 1;
+    }
+
+    return found;
+}
+
+#ifdef AESD_FRAMING_X86
+
+/*
+ * Both vector versions test AESD_FRAMING_BLOCK bytes or more at a time and take every
+ * delimiter in them from the compare masks.  Once blocks start coming up empty the rest of
+ * a delimiter free run is left to memchr, which is tuned for exactly that, and anything
+ * shorter than a block is left to memchr too.
+ */
+#define AESD_FRAMING_BLOCK 64
+
+/**
+ * Appends the delimiters marked in @param mask, found in the block starting at @param base,
+ * to ends.  @return the new number of offsets in ends.
+ */
+static inline size_t aesd_framing_add_mask(uint64_t mask, size_t base, size_t *ends, size_t found,
+            size_t max_ends)
+{
+    while(mask && found < max_ends)
+    {
+        ends[found++] = base + __builtin_ctzll(mask) + 1;
+        mask &= mask - 1;
+    }
+    return found;
+}
+
+/**
+ * Called for a delimiter free block at *@param i of @param step bytes, moves *i so the scan
+ * loop's next step lands on the following delimiter.
+ * @return false if there are no more delimiters in buf
+ */
+static inline bool aesd_framing_skip(const char *buf, size_t size, size_t *i, size_t step)
+{
+    const char *delimiter;
+
+    if(*i + step >= size)
+        return true;
+
+    delimiter = memchr(buf + *i + step, AESD_FRAMING_DELIMITER, size - *i - step);
+    if(!delimiter)
+        return false;
+
+    *i = delimiter - buf - step;
+    return true;
+}
+
+/**
+ * Finishes a vector scan that stopped at @param i, either because ends is full or fewer than
+ * AESD_FRAMING_BLOCK bytes are left.
+ */
+static inline size_t aesd_framing_find_tail(const char *buf, size_t size, size_t i, size_t *ends,
+            size_t found, size_t max_ends)
+{
+    size_t n, tail;
+
+    if(found == max_ends || i == size)
+        return found;
+
+    tail = aesd_framing_find_memchr(buf + i, size - i, ends, found, max_ends);
+    for(n = found; n < tail; n++)
+        ends[n] += i;
+    return tail;
+}
+
+static size_t aesd_framing_find_sse2(const char *buf, size_t size, size_t *ends, size_t max_ends)
+{
+    const __m128i delimiter = _mm_set1_epi8(AESD_FRAMING_DELIMITER);
+    size_t found = 0;
+    size_t i;
+
+    for(i = 0; i + AESD_FRAMING_BLOCK <= size && found < max_ends; i += AESD_FRAMING_BLOCK)
+    {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), delimiter);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 16)), delimiter);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 32)), delimiter);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 48)), delimiter);
+        uint64_t mask;
+
+        if(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))) == 0)
+        {
+            if(!aesd_framing_skip(buf, size, &i, AESD_FRAMING_BLOCK))
+                return found;
+            continue;
+        }
+
+        mask = (uint64_t)(uint16_t)_mm_movemask_epi8(a) |
+                (uint64_t)(uint16_t)_mm_movemask_epi8(b) << 16 |
+                (uint64_t)(uint16_t)_mm_movemask_epi8(c) << 32 |
+                (uint64_t)(uint16_t)_mm_movemask_epi8(d) << 48;
+        found = aesd_framing_add_mask(mask, i, ends, found, max_ends);
+    }
+
+    return aesd_framing_find_tail(buf, size, i, ends, found, max_ends);
+}
+
+__attribute__((target("avx2")))
+static size_t aesd_framing_find_avx2(const char *buf, size_t size, size_t *ends, size_t max_ends)
+{
+    const __m256i delimiter = _mm256_set1_epi8(AESD_FRAMING_DELIMITER);
+    size_t found = 0;
+    size_t i, half;
+
+    // two blocks per test keeps long delimiter free runs close to memchr speed
+    for(i = 0; i + 2 * AESD_FRAMING_BLOCK <= size && found < max_ends; i += 2 * AESD_FRAMING_BLOCK)
+    {
+        __m256i v[4];
+        __m256i any;
+
+        v[0] = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), delimiter);
+        v[1] = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 32)), delimiter);
+        v[2] = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 64)), delimiter);
+        v[3] = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 96)), delimiter);
+        any = _mm256_or_si256(_mm256_or_si256(v[0], v[1]), _mm256_or_si256(v[2], v[3]));
+        if(_mm256_testz_si256(any, any))
+        {
+            if(!aesd_framing_skip(buf, size, &i, 2 * AESD_FRAMING_BLOCK))
+                return found;
+            continue;
+        }
+
+        for(half = 0; half < 2; half++)
+        {
+            uint64_t mask = (uint64_t)(uint32_t)_mm256_movemask_epi8(v[2 * half]) |
+                    (uint64_t)(uint32_t)_mm256_movemask_epi8(v[2 * half + 1]) << 32;
+
+            found = aesd_framing_add_mask(mask, i + half * AESD_FRAMING_BLOCK, ends, found, max_ends);
+        }
+    }
+
+    return aesd_framing_find_tail(buf, size, i, ends, found, max_ends);
+}
+
+size_t aesd_framing_find_ends(const char *buf, size_t size, size_t *ends, size_t max_ends)
+{
+    static int have_avx2 = -1;
+
+    if(size < AESD_FRAMING_BLOCK)
+        return aesd_framing_find_memchr(buf, size, ends, 0, max_ends);
+
+    // benign race, every thread computes the same answer
+    if(have_avx2 < 0)
+        have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+
+    if(have_avx2)
+        return aesd_framing_find_avx2(buf, size, ends, max_ends);
+    return aesd_framing_find_sse2(buf, size, ends, max_ends);
+}
+
+#else
+
+size_t aesd_framing_find_ends(const char *buf, size_t size, size_t *ends, size_t max_ends)
+{
+    return aesd_framing_find_memchr(buf, size, ends, 0, max_ends);
+}
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * aesd-framing.h
+ *
+ *  @brief Newline packet framing shared by the aesdchar driver and aesdsocket.
+ *
+ *  Callers hand in only the bytes that arrived since the last call and get back the end
+ *  of every packet they contain, so accumulated partial packets are never scanned twice.
+ */
+
+#ifndef AESD_FRAMING_H
+#define AESD_FRAMING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // size_t
+#endif
+
+#define AESD_FRAMING_DELIMITER '\n'
+
+/**
+ * Finds the end of every packet in @param buf
+ * @param size the number of bytes in buf to scan
+ * @param ends filled, in order, with the offset just past each delimiter found in buf
+ * @param max_ends the number of offsets ends can hold
+ * @return the number of offsets stored in ends.  When this is max_ends there may be more
+ *      packets, scan again from buf + ends[max_ends - 1].
+ */
+size_t aesd_framing_find_ends(const char *buf, size_t size, size_t *ends, size_t max_ends);
+
+#endif /* AESD_FRAMING_H */
@@ -0,0 +1,166 @@
+/**
+ * @file aesd-snapshot.c
+ * @brief Saves the contents of an aesdchar device to a file and restores them after a reload
+ *
+ * Usage: aesd-snapshot save|restore <device> <file>
+ *
+ * The file holds the dump returned by AESDCHAR_IOCSNAPSHOT, see aesd_ioctl.h for the format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "aesd_ioctl.h"
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t written;
+
+    while(len > 0)
+    {
+        written = write(fd, buf, len);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+static int save(const char *device, const char *path)
+{
+    struct aesd_snapshot snapshot;
+    char *buf = NULL;
+    int devfd, outfd;
+    int rc = 1;
+
+    if((devfd = open(device, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        perror(device);
+        return 1;
+    }
+
+    memset(&snapshot, 0, sizeof(snapshot));
+
+    // ask for the size first, then retry in case entries were added in between
+    while(ioctl(devfd, AESDCHAR_IOCSNAPSHOT, &snapshot) == -1)
+    {
+        if(errno != ENOSPC)
+        {
+            perror("AESDCHAR_IOCSNAPSHOT");
+            goto escape;
+        }
+
+        free(buf);
+        if((buf = malloc(snapshot.needed)) == NULL)
+        {
+            perror("malloc");
+            goto escape;
+        }
+        snapshot.data = (uintptr_t)buf;
+        snapshot.size = snapshot.needed;
+    }
+
+    if((outfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+    {
+        perror(path);
+        goto escape;
+    }
+
+    if(write_all(outfd, buf, snapshot.needed) == -1 || fsync(outfd) == -1)
+        perror(path);
+    else
+        rc = 0;
+
+    close(outfd);
+
+escape:
+    free(buf);
+    close(devfd);
+    return rc;
+}
+
+static int restore(const char *device, const char *path)
+{
+    struct aesd_snapshot snapshot;
+    struct stat st;
+    char *buf = NULL;
+    ssize_t got;
+    size_t total = 0;
+    int devfd = -1, infd;
+    int rc = 1;
+
+    if((infd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        perror(path);
+        return 1;
+    }
+
+    if(fstat(infd, &st) == -1 || (buf = malloc(st.st_size)) == NULL)
+    {
+        perror(path);
+        goto escape;
+    }
+
+    while(total < (size_t)st.st_size)
+    {
+        got = read(infd, buf + total, st.st_size - total);
+        if(got <= 0)
+        {
+            if(got < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "%s: short read\n", path);
+            goto escape;
+        }
+        total += got;
+    }
+
+    if((devfd = open(device, O_WRONLY | O_CLOEXEC)) == -1)
+    {
+        perror(device);
+        goto escape;
+    }
+
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.data = (uintptr_t)buf;
+    snapshot.size = total;
+
+    if(ioctl(devfd, AESDCHAR_IOCRESTORE, &snapshot) == -1)
+        perror("AESDCHAR_IOCRESTORE");
+    else
+        rc = 0;
+
+escape:
+    if(devfd != -1)
+        close(devfd);
+    free(buf);
+    close(infd);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 4)
+    {
+        fprintf(stderr, "usage: %s save|restore <device> <file>\n", argv[0]);
+        return 1;
+    }
+
+    if(strcmp(argv[1], "save") == 0)
+        return save(argv[2], argv[3]);
+
+    if(strcmp(argv[1], "restore") == 0)
+        return restore(argv[2], argv[3]);
+
+    fprintf(stderr, "unknown command %s\n", argv[1]);
+    return 1;
+}
@@ -33,14 +33,215 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Passed with AESDCHAR_IOCAPPEND to commit several packets with one call
+ */
+struct aesd_append {
+    /**
+     * User space address of one or more newline terminated packets stored back to back
+     */
+    uint64_t data;
+    /**
+     * Number of bytes at data, the last one must be a newline.  Batches over 16 MiB fail
+     * with E2BIG.
+     */
+    uint64_t size;
+    /**
+     * Set by the driver to the number of entries committed
+     */
+    uint32_t entries;
+    uint32_t reserved;
+};
+
+/**
+ * Passed with AESDCHAR_IOCREADENTRIES to read a range of whole entries with one call
+ */
+struct aesd_read_entries {
+    /**
+     * The zero referenced write command to start reading from, counted like aesd_seekto.write_cmd
+     */
+    uint32_t first_cmd;
+    /**
+     * The number of write commands to read
+     */
+    uint32_t count;
+    /**
+     * User space address of the buffer receiving the entries back to back
+     */
+    uint64_t data;
+    /**
+     * Number of bytes available at data
+     */
+    uint64_t size;
+    /**
+     * User space address of an array of count uint32_t, set to the length of each entry read.
+     * If an entry does not fit in the remaining space its length is still reported.
+     */
+    uint64_t lengths;
+    /**
+     * Set by the driver to the number of whole entries copied to data
+     */
+    uint32_t entries;
+    uint32_t reserved;
+};
+
+/**
+ * Filled in by AESDCHAR_IOCQSEQRANGE.  Every committed entry gets the next 64 bit sequence number,
+ * so the stored entries are exactly oldest..newest.  When nothing is stored newest is oldest - 1.
+ */
+struct aesd_seq_range {
+    uint64_t oldest;
+    uint64_t newest;
+};
+
+/**
+ * Passed with AESDCHAR_IOCSEEKSEQ to seek to an entry by sequence number
+ */
+struct aesd_seekseq {
+    /**
+     * Sequence number of the entry to seek to.  newest + 1 seeks to the end of the data,
+     * ready to read the next entry written.  Entries older than the oldest stored one fail
+     * with ESTALE.
+     */
+    uint64_t seq;
+    /**
+     * The zero referenced offset within the entry
+     */
+    uint32_t offset;
+    uint32_t reserved;
+};
+
+/**
+ * Snapshot dump format produced by AESDCHAR_IOCSNAPSHOT and accepted by AESDCHAR_IOCRESTORE:
+ * one struct aesd_snapshot_header, then for each entry, oldest first, a struct
+ * aesd_snapshot_entry immediately followed by its size bytes of payload.
+ * All fields are in host byte order.
+ */
+#define AESD_SNAPSHOT_MAGIC 0x44534541 /* "AESD" */
+#define AESD_SNAPSHOT_VERSION 1
+
+struct aesd_snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    /**
+     * Sequence number the device will give its next entry
+     */
+    uint64_t next_seq;
+    /**
+     * Number of entries following the header
+     */
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct aesd_snapshot_entry {
+    uint64_t seq;
+    uint64_t timestamp_ns;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+/**
+ * Passed with AESDCHAR_IOCSNAPSHOT and AESDCHAR_IOCRESTORE
+ */
+struct aesd_snapshot {
+    /**
+     * User space address of the dump
+     */
+    uint64_t data;
+    /**
+     * Number of bytes available at data for a snapshot, or the size of the dump to restore
+     */
+    uint64_t size;
+    /**
+     * Set by AESDCHAR_IOCSNAPSHOT to the size of the dump, also when it fails with ENOSPC
+     */
+    uint64_t needed;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Commit every newline terminated packet in a buffer as its own entry under one lock hold
+#define AESDCHAR_IOCAPPEND _IOWR(AESD_IOC_MAGIC, 2, struct aesd_append)
+// Copy the entries [first_cmd, first_cmd + count) to a user buffer
+#define AESDCHAR_IOCREADENTRIES _IOWR(AESD_IOC_MAGIC, 3, struct aesd_read_entries)
+// Query the sequence numbers of the oldest and newest stored entries
+#define AESDCHAR_IOCQSEQRANGE _IOR(AESD_IOC_MAGIC, 4, struct aesd_seq_range)
+// Seek to an entry by sequence number
+#define AESDCHAR_IOCSEEKSEQ _IOW(AESD_IOC_MAGIC, 5, struct aesd_seekseq)
+// Dump the stored entries in the snapshot format
+#define AESDCHAR_IOCSNAPSHOT _IOWR(AESD_IOC_MAGIC, 6, struct aesd_snapshot)
+// Load a snapshot into a device which has not been written to since the module was loaded
+#define AESDCHAR_IOCRESTORE _IOW(AESD_IOC_MAGIC, 7, struct aesd_snapshot)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 7
+
+/**
+ * Layout of the read-only mapping returned by mmap() on an aesdchar device loaded with a
+ * non zero ring_size.  The first page holds a struct aesd_mmap_header, followed by a
+ * data ring of header.data_size bytes holding a copy of every stored entry.
+ *
+ * The header is updated with a sequence count: seq is odd while the driver is changing
+ * the header or the data ring.  A reader should load seq, wait for it to be even, copy
+ * what it needs out of the header and data ring, then load seq again and retry if it changed.
+ */
+#define AESD_MMAP_VERSION 2
+#define AESD_MMAP_MAX_ENTRIES 64
+/**
+ * Position used for entries which are larger than the data ring and were not copied into it
+ */
+#define AESD_MMAP_POS_NONE UINT64_MAX
+
+struct aesd_mmap_entry {
+    /**
+     * Position of the entry in the data ring, counted in bytes since the ring was created.
+     * The entry starts at byte (pos % data_size) of the data ring and never wraps around its end.
+     */
+    uint64_t pos;
+    /**
+     * Number of bytes in the entry
+     */
+    uint32_t size;
+    uint32_t reserved;
+    /**
+     * Sequence number of the entry, see AESDCHAR_IOCQSEQRANGE
+     */
+    uint64_t seq;
+};
+
+struct aesd_mmap_header {
+    /**
+     * Sequence count, odd while an update is in progress
+     */
+    uint32_t seq;
+    /**
+     * AESD_MMAP_VERSION of this layout
+     */
+    uint32_t version;
+    /**
+     * Offset of the data ring from the start of the mapping
+     */
+    uint64_t data_offset;
+    /**
+     * Size of the data ring in bytes
+     */
+    uint64_t data_size;
+    /**
+     * Total number of bytes ever placed in the data ring.  An entry is still intact
+     * while head - pos <= data_size.
+     */
+    uint64_t head;
+    /**
+     * Number of valid members of entry, oldest first
+     */
+    uint32_t count;
+    uint32_t reserved;
+    struct aesd_mmap_entry entry[AESD_MMAP_MAX_ENTRIES];
+};
 
 #endif /* AESD_IOCTL_H */
@@ -8,7 +8,7 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -25,14 +25,51 @@
 
 #include "aesd-circular-buffer.h"
 
+#define AESD_HIST_BUCKETS 16
+
+/*
+ * Per-CPU statistics, summed when read through debugfs.  Histogram bucket 0 counts times
+ * under 1us, bucket n counts times in [2^(n-1), 2^n) us, the last bucket is open ended.
+ */
+struct aesd_stats
+{
+     u64 bytes_written;
+     u64 entries_written;
+     u64 bytes_read;
+     u64 evictions;
+     s64 partial_bytes;    /* Bytes held in partial writes, per-CPU values may be negative */
+     u64 lock_contended;
+     u64 lock_wait_hist[AESD_HIST_BUCKETS];
+     u64 lock_hold_hist[AESD_HIST_BUCKETS];
+};
+
 struct aesd_dev
 {
      struct mutex lock;
+     u64 lock_acquired_ns; /* When the current lock holder got the lock */
+     struct aesd_stats __percpu *stats;
+     unsigned int minor;
+     wait_queue_head_t readq;  /* Readers waiting for a new entry */
      struct aesd_circular_buffer buffer;
-     char *partial_write;
-     size_t partial_write_size;
+     u64 next_seq;         /* Sequence number given to the next committed entry */
+     void *ring;           /* Header page + data ring exposed by mmap, NULL if disabled */
+     size_t ring_size;     /* Size of the data ring in bytes */
+     bool arena;           /* Entries live in the data ring rather than in kmalloc buffers */
+     u64 ring_head;        /* Bytes ever placed in the data ring */
+     u64 ring_pos[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]; /* Ring position of each buffer slot */
      struct cdev cdev;     /* Char device structure */
 };
 
+/*
+ * Per open file state, stored in filp->private_data
+ */
+struct aesd_file
+{
+     struct aesd_dev *dev;
+     struct mutex lock;    /* Serialises writers sharing this open file */
+     char *partial_write;  /* Bytes written since the last newline, not yet in the buffer */
+     size_t partial_write_size;
+     u64 seen_total;       /* buffer.total when reads last reached the end or the position was set */
+};
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -0,0 +1,84 @@
+/*
+ * aesdchar_trace.h
+ *
+ *  @brief Tracepoints for the aesdchar driver, enabled under
+ *  /sys/kernel/tracing/events/aesdchar/
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(aesd_commit,
+    TP_PROTO(unsigned int minor, u64 seq, size_t size),
+    TP_ARGS(minor, seq, size),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u64, seq)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->seq = seq;
+        __entry->size = size;
+    ),
+    TP_printk("minor=%u seq=%llu size=%zu", __entry->minor, __entry->seq, __entry->size)
+);
+
+TRACE_EVENT(aesd_evict,
+    TP_PROTO(unsigned int minor, u64 seq, size_t size),
+    TP_ARGS(minor, seq, size),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u64, seq)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->seq = seq;
+        __entry->size = size;
+    ),
+    TP_printk("minor=%u seq=%llu size=%zu", __entry->minor, __entry->seq, __entry->size)
+);
+
+TRACE_EVENT(aesd_read,
+    TP_PROTO(unsigned int minor, loff_t pos, ssize_t ret),
+    TP_ARGS(minor, pos, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u pos=%lld ret=%zd", __entry->minor, __entry->pos, __entry->ret)
+);
+
+TRACE_EVENT(aesd_seek,
+    TP_PROTO(unsigned int minor, loff_t pos),
+    TP_ARGS(minor, pos),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+    ),
+    TP_printk("minor=%u pos=%lld", __entry->minor, __entry->pos)
+);
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Checks that a blocking reader waiting at the end of a full aesdchar buffer wakes up for new
+# writes, including writes no larger than the entry they evict, which leave the buffer size
+# at or below the reader's position.
+# Usage: blocking-read-test.sh
+# Run as root, loads the module from this directory with blocking reads and unloads it again.
+
+set -e
+set -u
+cd `dirname $0`
+
+DEVICE=/dev/aesdchar0
+OUTPUT=$(mktemp)
+READER=""
+
+cleanup()
+{
+	[ -n "$READER" ] && kill $READER 2>/dev/null || true
+	rm -f $OUTPUT
+	./aesdchar_unload || true
+}
+
+./aesdchar_load blocking_read=1 nr_devs=1
+trap cleanup EXIT
+
+# fill every entry with lines of the same size
+for i in 0 1 2 3 4 5 6 7 8 9
+do
+	printf 'line %s\n' $i > $DEVICE
+done
+
+cat $DEVICE > $OUTPUT &
+READER=$!
+
+# every write evicts an entry of the same size, the reader has to see each one anyway
+for i in a b c
+do
+	sleep 0.5
+	printf 'line %s\n' $i > $DEVICE
+	sleep 0.5
+	if [ "$(tail -n 1 $OUTPUT)" != "line $i" ]
+	then
+		echo "failed: blocked reader did not get line $i, it read"
+		cat $OUTPUT
+		exit 1
+	fi
+done
+
+echo "success"
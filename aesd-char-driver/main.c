@@ -17,30 +17,446 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/uio.h> // iov_iter
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/timekeeping.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+#include "aesd-framing.h"
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
 MODULE_AUTHOR("Risheek Mairal");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+// when set, readers without O_NONBLOCK sleep at end of data instead of returning 0
+static bool aesd_blocking_read = false;
+module_param_named(blocking_read, aesd_blocking_read, bool, 0644);
+MODULE_PARM_DESC(blocking_read, "Block readers at end of data until a new entry is written");
+
+// size of the mmap data ring in bytes, 0 disables mmap support
+static unsigned long aesd_ring_size = 0;
+module_param_named(ring_size, aesd_ring_size, ulong, 0444);
+MODULE_PARM_DESC(ring_size, "Size in bytes of the read-only history ring exposed through mmap (0 to disable)");
+
+// number of /dev/aesdcharN minors, each with its own buffer and lock
+static unsigned int aesd_nr_devs = 1;
+module_param_named(nr_devs, aesd_nr_devs, uint, 0444);
+MODULE_PARM_DESC(nr_devs, "Number of aesdchar devices to create");
+
+// store entries directly in the ring instead of one kmalloc per entry
+static bool aesd_arena = false;
+module_param_named(arena, aesd_arena, bool, 0444);
+MODULE_PARM_DESC(arena, "Store entries in the ring_size byte ring instead of individual kmalloc buffers");
+
+// largest dump accepted by AESDCHAR_IOCRESTORE
+#define AESD_SNAPSHOT_MAX_SIZE (64 * 1024 * 1024)
+
+// largest batch accepted by AESDCHAR_IOCAPPEND, it is copied into the kernel in one piece
+#define AESD_APPEND_MAX_SIZE (16 * 1024 * 1024)
+
+struct aesd_dev *aesd_devices;
+static struct dentry *aesd_debugfs_root;
+
+static unsigned int aesd_hist_bucket(u64 ns)
+{
+    u64 us = ns >> 10;
+
+    if(us == 0)
+        return 0;
+
+    return min_t(unsigned int, ilog2(us) + 1, AESD_HIST_BUCKETS - 1);
+}
+
+/**
+ * Takes dev->lock, counting contention and the time spent waiting for it
+ */
+static int aesd_lock(struct aesd_dev *dev)
+{
+    u64 start;
+
+    if(!mutex_trylock(&dev->lock))
+    {
+        this_cpu_inc(dev->stats->lock_contended);
+        start = ktime_get_ns();
+        if(mutex_lock_interruptible(&dev->lock))
+            return -ERESTARTSYS;
+        dev->lock_acquired_ns = ktime_get_ns();
+        this_cpu_inc(dev->stats->lock_wait_hist[aesd_hist_bucket(dev->lock_acquired_ns - start)]);
+        return 0;
+    }
+
+    dev->lock_acquired_ns = ktime_get_ns();
+    this_cpu_inc(dev->stats->lock_wait_hist[0]);
+    return 0;
+}
+
+static void aesd_unlock(struct aesd_dev *dev)
+{
+    u64 held = ktime_get_ns() - dev->lock_acquired_ns;
+
+    mutex_unlock(&dev->lock);
+    this_cpu_inc(dev->stats->lock_hold_hist[aesd_hist_bucket(held)]);
+}
+
+static inline struct aesd_dev *aesd_filp_dev(struct file *filp)
+{
+    return ((struct aesd_file *)filp->private_data)->dev;
+}
+
+/**
+ * Records that @param file has seen everything added to the buffer so far.  Must be called
+ * with the device lock held, whenever a read of @param file reaches the end of the buffer
+ * or its position is set.
+ */
+static void aesd_mark_seen(struct aesd_dev *dev, struct aesd_file *file)
+{
+    WRITE_ONCE(file->seen_total, dev->buffer.total);
+}
+
+/**
+ * @return true if there is data in the buffer past @param pos, or data added since @param file
+ * last reached the end.  Positions count from the oldest stored byte, so once the buffer is
+ * full and every add evicts an entry, size can stay at or below the reader's position while
+ * data keeps arriving; total only grows.  Called without the lock held as a wait condition,
+ * any stale result is corrected by the caller re-checking under the lock.
+ */
+static bool aesd_data_available(struct aesd_dev *dev, struct aesd_file *file, loff_t pos)
+{
+    return pos < READ_ONCE(dev->buffer.size) || READ_ONCE(dev->buffer.total) != READ_ONCE(file->seen_total);
+}
+
+/**
+ * Moves a reader left at or past the end of the buffer to the first byte added since @param file
+ * last reached the end, or to the oldest stored byte if that has been evicted already.  Must be
+ * called with the device lock held.
+ */
+static void aesd_catch_up(struct aesd_dev *dev, struct aesd_file *file, loff_t *pos)
+{
+    u64 oldest = dev->buffer.total - dev->buffer.size;
+
+    if(*pos < dev->buffer.size || file->seen_total == dev->buffer.total)
+        return;
+
+    *pos = (file->seen_total > oldest) ? file->seen_total - oldest : 0;
+}
+
+/**
+ * Sleeps until there is data past @param pos if blocking reads are enabled for @param filp.
+ * @return 0 when the caller should go ahead with the read, or a negative error code.
+ */
+static int aesd_wait_for_data(struct aesd_dev *dev, struct file *filp, loff_t pos)
+{
+    struct aesd_file *file = filp->private_data;
+
+    if(!aesd_blocking_read || aesd_data_available(dev, file, pos))
+        return 0;
+
+    if(filp->f_flags & O_NONBLOCK)
+        return -EAGAIN;
+
+    if(wait_event_interruptible(dev->readq, aesd_data_available(dev, file, pos)))
+        return -ERESTARTSYS;
+
+    return 0;
+}
+
+static int aesd_ring_init(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header;
+
+    BUILD_BUG_ON(sizeof(struct aesd_mmap_header) > PAGE_SIZE);
+    BUILD_BUG_ON(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED > AESD_MMAP_MAX_ENTRIES);
+
+    if(!aesd_ring_size)
+        return 0;
+
+    dev->arena = aesd_arena;
+
+    dev->ring_size = PAGE_ALIGN(aesd_ring_size);
+    dev->ring = vmalloc_user(PAGE_SIZE + dev->ring_size);
+    if(!dev->ring)
+        return -ENOMEM;
+
+    header = dev->ring;
+    header->version = AESD_MMAP_VERSION;
+    header->data_offset = PAGE_SIZE;
+    header->data_size = dev->ring_size;
+
+    return 0;
+}
+
+/**
+ * Marks the mmap header as being updated.  Must be called with dev->lock held.
+ */
+static void aesd_ring_begin(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->ring;
+
+    WRITE_ONCE(header->seq, header->seq + 1);
+    smp_wmb();
+}
+
+/**
+ * Republishes the entry table in the mmap header and ends the update started by aesd_ring_begin().
+ * Must be called with dev->lock held.
+ */
+static void aesd_ring_end(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->ring;
+    uint32_t count = 0;
+    uint32_t index;
+
+    index = dev->buffer.out_offs;
+    do
+    {
+        if(!dev->buffer.entry[index].buffptr)
+            break;
+
+        header->entry[count].pos = dev->ring_pos[index];
+        header->entry[count].size = dev->buffer.entry[index].size;
+        header->entry[count].seq = dev->buffer.entry[index].seq;
+        count++;
+        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    } while(index != dev->buffer.in_offs);
+
+    header->head = dev->ring_head;
+    header->count = count;
+
+    smp_wmb();
+    WRITE_ONCE(header->seq, header->seq + 1);
+}
+
+/**
+ * Reserves @param size contiguous bytes at the head of the data ring, which must be no larger than it.
+ * @param dest is set to the reserved bytes.
+ * @return the ring position of the reservation
+ */
+static u64 aesd_ring_reserve(struct aesd_dev *dev, size_t size, char **dest)
+{
+    u64 ring_offset;
+    u64 pos;
+
+    // never split an entry across the end of the ring, skip to the start instead
+    div64_u64_rem(dev->ring_head, dev->ring_size, &ring_offset);
+    if(ring_offset + size > dev->ring_size)
+    {
+        dev->ring_head += dev->ring_size - ring_offset;
+        ring_offset = 0;
+    }
+
+    pos = dev->ring_head;
+    dev->ring_head += size;
+    *dest = (char *)dev->ring + PAGE_SIZE + ring_offset;
+
+    return pos;
+}
+
+/**
+ * Counts and traces the eviction of the oldest entry, which the caller is about to drop
+ */
+static void aesd_account_eviction(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry *oldest = &dev->buffer.entry[dev->buffer.out_offs];
+
+    this_cpu_inc(dev->stats->evictions);
+    trace_aesd_evict(dev->minor, oldest->seq, oldest->size);
+}
+
+/**
+ * Adds the complete packet in @param data to the device buffer, evicting the oldest entries
+ * when the buffer is full.  Must be called with dev->lock held.
+ *
+ * In kmalloc mode the buffer takes ownership of @param data, which must be kmalloc'd, and
+ * frees the entry it replaces.  In arena mode @param data is copied into the data ring, older
+ * entries whose bytes it overwrites are evicted, and @param data stays with the caller.
+ * Arena mode callers must not pass more than dev->ring_size bytes.
+ * The entry is stored with sequence number @param seq and commit time @param timestamp_ns.
+ */
+static void aesd_store_entry(struct aesd_dev *dev, const char *data, size_t size, u64 seq, u64 timestamp_ns)
+{
+    struct aesd_buffer_entry add_entry;
+    struct aesd_buffer_entry removed;
+    const char *evicted = NULL;
+    char *dest = NULL;
+    u64 pos = AESD_MMAP_POS_NONE;
+    uint32_t slot;
+
+    if(dev->ring)
+        aesd_ring_begin(dev);
+
+    if(dev->ring && size <= dev->ring_size)
+        pos = aesd_ring_reserve(dev, size, &dest);
+
+    if(dev->arena)
+    {
+        // drop every entry whose bytes the reservation is about to overwrite
+        while((dev->buffer.full || dev->buffer.in_offs != dev->buffer.out_offs) &&
+                dev->ring_head - dev->ring_pos[dev->buffer.out_offs] > dev->ring_size)
+        {
+            aesd_account_eviction(dev);
+            aesd_circular_buffer_remove_entry(&dev->buffer, &removed);
+        }
+    }
+
+    if(dev->buffer.full)
+    {
+        aesd_account_eviction(dev);
+        if(!dev->arena)
+            evicted = dev->buffer.entry[dev->buffer.out_offs].buffptr;
+    }
+
+    if(dest)
+        memcpy(dest, data, size);
+
+    add_entry.buffptr = dev->arena ? dest : data;
+    add_entry.size = size;
+    add_entry.seq = seq;
+    add_entry.timestamp_ns = timestamp_ns;
+
+    slot = dev->buffer.in_offs;
+    aesd_circular_buffer_add_entry(&dev->buffer, &add_entry);
+
+    if(dev->ring)
+    {
+        dev->ring_pos[slot] = pos;
+        aesd_ring_end(dev);
+    }
+
+    this_cpu_inc(dev->stats->entries_written);
+    this_cpu_add(dev->stats->bytes_written, size);
+    trace_aesd_commit(dev->minor, add_entry.seq, size);
+
+    kfree(evicted);
+    wake_up_interruptible(&dev->readq);
+}
+
+/**
+ * Stores a newly written packet with the next sequence number, see aesd_store_entry()
+ */
+static void aesd_commit_entry(struct aesd_dev *dev, const char *data, size_t size)
+{
+    aesd_store_entry(dev, data, size, dev->next_seq++, ktime_get_real_ns());
+}
+
+/**
+ * Finds the end of every packet in @param buf, only looking for newlines from @param scan_from
+ * on since the bytes before it are known not to hold any.  The end offsets, relative to buf,
+ * are stored in @param small when its @param nsmall slots are enough and in a kvcalloc'd array
+ * otherwise, *@param ends_rtn points at whichever was used.
+ * In arena mode every packet must fit the data ring.
+ * @return the number of packets or a negative errno
+ */
+static long aesd_frame_packets(struct aesd_dev *dev, const char *buf, size_t size, size_t scan_from,
+            size_t *small, size_t nsmall, size_t **ends_rtn)
+{
+    size_t *ends;
+    size_t offset, start, end, found, i;
+    size_t npackets = 0;
+
+    *ends_rtn = small;
+
+    // count a batch at a time, the first batch is all most writes have
+    start = 0;
+    for(offset = scan_from; offset < size; offset += small[found - 1])
+    {
+        found = aesd_framing_find_ends(buf + offset, size - offset, small, nsmall);
+        for(i = 0; i < found; i++)
+        {
+            end = offset + small[i];
+            if(dev->arena && end - start > dev->ring_size)
+                return -EFBIG;
+            start = end;
+        }
+        npackets += found;
+        if(found < nsmall)
+            break;
+    }
+
+    // with more than one batch small only holds the last one, find them all again
+    if(npackets > nsmall)
+    {
+        ends = kvcalloc(npackets, sizeof(*ends), GFP_KERNEL);
+        if(!ends)
+            return -ENOMEM;
+        aesd_framing_find_ends(buf + scan_from, size - scan_from, ends, npackets);
+        *ends_rtn = ends;
+    }
+
+    for(i = 0; i < npackets; i++)
+        (*ends_rtn)[i] += scan_from;
+
+    return npackets;
+}
+
+/**
+ * Commits the @param npackets packets framed by @param ends, see aesd_frame_packets(), as
+ * separate entries.  In arena mode they are copied from @param buf, otherwise the kmalloc'd
+ * @param packets are handed to the buffer and cleared.  Must be called with dev->lock held.
+ */
+static void aesd_commit_packets(struct aesd_dev *dev, const char *buf, char **packets,
+            const size_t *ends, long npackets)
+{
+    size_t start = 0;
+    long i;
+
+    for(i = 0; i < npackets; start = ends[i++])
+    {
+        if(dev->arena)
+        {
+            aesd_commit_entry(dev, buf + start, ends[i] - start);
+        }
+        else
+        {
+            aesd_commit_entry(dev, packets[i], ends[i] - start);
+            packets[i] = NULL;
+        }
+    }
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file;
+
     PDEBUG("open");
 
-    struct aesd_dev *dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
+    file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if(!file)
+        return -ENOMEM;
+
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    mutex_init(&file->lock);
+    // a racing add is either seen as new data or read from position 0, both deliver it
+    file->seen_total = READ_ONCE(file->dev->buffer.total);
+    filp->private_data = file;
 
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
+
     PDEBUG("release");
 
+    // an unterminated partial write is dropped with the file, it never reached the buffer
+    this_cpu_sub(file->dev->stats->partial_bytes, file->partial_write_size);
+    kfree(file->partial_write);
+    kfree(file);
+
     return 0;
 }
 
@@ -48,34 +464,116 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     ssize_t retval = 0;
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_dev *dev = aesd_filp_dev(filp);
     size_t entry_offset = 0;
     struct aesd_buffer_entry* buf_read = NULL;
     size_t read_size = 0;
 
     PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
 
-    if(mutex_lock_interruptible(&dev->lock))
+retry:
+    retval = aesd_wait_for_data(dev, filp, *f_pos);
+    if(retval < 0)
+        return retval;
+
+    if(aesd_lock(dev))
         return -ERESTARTSYS;
 
-    buf_read = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset);
+    aesd_catch_up(dev, filp->private_data, f_pos);
 
-    if(!buf_read)
-        goto escape;
+    // keep copying from consecutive entries until the user buffer is full or we run out of data
+    while(count > 0)
+    {
+        buf_read = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset);
+        if(!buf_read)
+        {
+            aesd_mark_seen(dev, filp->private_data);
+            break;
+        }
+
+        read_size = min(count, buf_read->size - entry_offset);
+
+        if(copy_to_user(buf, buf_read->buffptr + entry_offset, read_size) > 0)
+        {
+            if(retval == 0)
+                retval = -EFAULT;
+            goto escape;
+        }
+
+        buf += read_size;
+        count -= read_size;
+        retval += read_size;
+        *f_pos += read_size;
+    }
+
+escape:
+    aesd_unlock(dev);
+
+    if(retval > 0)
+        this_cpu_add(dev->stats->bytes_read, retval);
+    trace_aesd_read(dev->minor, *f_pos, retval);
 
-    read_size = min(count, buf_read->size - entry_offset);
+    // the data we woke up for may have been evicted before we got the lock
+    if(retval == 0 && count > 0 && aesd_blocking_read)
+        goto retry;
 
-    if(copy_to_user(buf, buf_read->buffptr + entry_offset, read_size) > 0)
+    return retval;
+}
+
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t retval = 0;
+    struct aesd_dev *dev = aesd_filp_dev(iocb->ki_filp);
+    size_t entry_offset = 0;
+    struct aesd_buffer_entry* buf_read = NULL;
+    size_t read_size = 0;
+    size_t copied = 0;
+
+    PDEBUG("read_iter %zu bytes with offset %lld", iov_iter_count(to), iocb->ki_pos);
+
+retry:
+    retval = aesd_wait_for_data(dev, iocb->ki_filp, iocb->ki_pos);
+    if(retval < 0)
+        return retval;
+
+    if(aesd_lock(dev))
+        return -ERESTARTSYS;
+
+    aesd_catch_up(dev, iocb->ki_filp->private_data, &iocb->ki_pos);
+
+    // same as aesd_read, but fills every iovec of a readv/preadv under one lock hold
+    while(iov_iter_count(to) > 0)
     {
-        retval = -EFAULT;
-        goto escape;
+        buf_read = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, iocb->ki_pos, &entry_offset);
+        if(!buf_read)
+        {
+            aesd_mark_seen(dev, iocb->ki_filp->private_data);
+            break;
+        }
+
+        read_size = min(iov_iter_count(to), buf_read->size - entry_offset);
+        copied = copy_to_iter(buf_read->buffptr + entry_offset, read_size, to);
+
+        retval += copied;
+        iocb->ki_pos += copied;
+
+        if(copied < read_size)
+        {
+            if(retval == 0)
+                retval = -EFAULT;
+            break;
+        }
     }
 
-    retval = read_size;
-    *f_pos += retval;
+    aesd_unlock(dev);
+
+    if(retval > 0)
+        this_cpu_add(dev->stats->bytes_read, retval);
+    trace_aesd_read(dev->minor, iocb->ki_pos, retval);
+
+    if(retval == 0 && iov_iter_count(to) > 0 && aesd_blocking_read)
+        goto retry;
 
-escape:
-    mutex_unlock(&dev->lock);
     return retval;
 }
 
@@ -83,115 +581,215 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     ssize_t retval = -ENOMEM;
-    struct aesd_dev *dev = filp->private_data;
-    char *kcharbuffer = NULL;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
     char *knewbuffer = NULL;
-    size_t full_size = 0;
-    struct aesd_buffer_entry add_entry;
-    struct aesd_buffer_entry *oldest = NULL;
+    char *tail = NULL;
+    char *small_packets[8] = { NULL };
+    char **packets = small_packets;
+    size_t small_ends[8];
+    size_t *ends = small_ends;
+    size_t old_size, full_size, committed;
+    long npackets = 0;
+    long first = 1;
+    long copied = 0;
+    long i;
 
     PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
 
-    if(mutex_lock_interruptible(&dev->lock))
+    if(count == 0)
+        return 0;
+
+    // partial writes are private to this open file, only the commit needs the device lock
+    if(mutex_lock_interruptible(&file->lock))
         return -ERESTARTSYS;
 
-    kcharbuffer = kmalloc(count, GFP_KERNEL);
-    if(!kcharbuffer)
+    old_size = file->partial_write_size;
+    full_size = old_size + count;
+    knewbuffer = krealloc(file->partial_write, full_size, GFP_KERNEL);
+    if(!knewbuffer)
         goto escape;
+    file->partial_write = knewbuffer;
 
-    if(copy_from_user(kcharbuffer, buf, count) > 0)
+    if(copy_from_user(file->partial_write + old_size, buf, count) > 0)
     {
-        kfree(kcharbuffer);
         retval = -EFAULT;
         goto escape;
     }
 
-    if(dev->partial_write)
+    // until the packets are committed the write has not happened, failures leave partial_write_size alone
+    npackets = aesd_frame_packets(dev, file->partial_write, full_size, old_size,
+            small_ends, ARRAY_SIZE(small_ends), &ends);
+    if(npackets < 0)
     {
-        full_size = count + dev->partial_write_size;
-        knewbuffer = kmalloc(full_size, GFP_KERNEL);
-        if(!knewbuffer)
-        {
-            kfree(kcharbuffer);
-            goto escape;
-        }
-
-        memcpy(knewbuffer, dev->partial_write, dev->partial_write_size);
-        memcpy(knewbuffer + dev->partial_write_size, kcharbuffer, count);
-
-        kfree(kcharbuffer);
-        kfree(dev->partial_write);
-        dev->partial_write = knewbuffer;
-        dev->partial_write_size = full_size;
-    }
-    else
-    {
-        dev->partial_write = kcharbuffer;
-        dev->partial_write_size = count;
+        retval = npackets;
+        goto escape;
     }
 
-    if(memchr(dev->partial_write, '\n', dev->partial_write_size) != NULL)
+    if(npackets == 0)
     {
-        full_size = dev->partial_write_size;
-        char *entrybuf = kmalloc(full_size, GFP_KERNEL);
-        if(!entrybuf)
-            goto escape;
+        file->partial_write_size = full_size;
+        this_cpu_add(dev->stats->partial_bytes, count);
+        retval = count;
+        goto escape;
+    }
 
-        memcpy(entrybuf, dev->partial_write, full_size);
-        add_entry.buffptr = entrybuf;
-        add_entry.size = full_size;
+    committed = ends[npackets - 1];
 
-        if(dev->buffer.full)
+    // arena mode copies straight out of the partial write buffer, which is kept for the next write
+    if(!dev->arena)
+    {
+        if(npackets > ARRAY_SIZE(small_packets))
         {
-            oldest = &dev->buffer.entry[dev->buffer.out_offs];
-            if(oldest->buffptr)
+            packets = kvcalloc(npackets, sizeof(*packets), GFP_KERNEL);
+            if(!packets)
             {
-                kfree(oldest->buffptr);
-                oldest->buffptr = NULL;
-                oldest->size = 0;
+                packets = small_packets;
+                goto escape;
             }
         }
 
-        aesd_circular_buffer_add_entry(&dev->buffer, &add_entry);
-        *f_pos += full_size;
+        // the first packet takes over the partial write buffer when it is the whole buffer, otherwise
+        // every packet and the tail get copies, so an entry never pins more memory than it holds
+        if(full_size > ends[0])
+            first = 0;
+        for(i = first; i < npackets; i++)
+        {
+            packets[i] = kmemdup(file->partial_write + (i ? ends[i - 1] : 0), ends[i] - (i ? ends[i - 1] : 0),
+                    GFP_KERNEL);
+            if(!packets[i])
+                goto escape;
+            copied = i + 1;
+        }
 
-        kfree(dev->partial_write);
-        dev->partial_write = NULL;
-        dev->partial_write_size = 0;
+        if(full_size > committed)
+        {
+            tail = kmemdup(file->partial_write + committed, full_size - committed, GFP_KERNEL);
+            if(!tail)
+                goto escape;
+        }
     }
 
+    if(aesd_lock(dev))
+    {
+        retval = -ERESTARTSYS;
+        goto escape;
+    }
+
+    if(!dev->arena && first)
+        packets[0] = file->partial_write;
+    aesd_commit_packets(dev, file->partial_write, packets, ends, npackets);
+    aesd_unlock(dev);
+
+    if(dev->arena)
+    {
+        memmove(file->partial_write, file->partial_write + committed, full_size - committed);
+    }
+    else
+    {
+        if(!first)
+            kfree(file->partial_write);
+        file->partial_write = tail;
+        tail = NULL;
+    }
+    file->partial_write_size = full_size - committed;
+
+    this_cpu_add(dev->stats->partial_bytes, (s64)file->partial_write_size - (s64)old_size);
+
+    *f_pos += committed;
     retval = count;
 
 escape:
-    mutex_unlock(&dev->lock);
+    for(i = first; i < copied; i++)
+        kfree(packets[i]);
+    if(packets != small_packets)
+        kvfree(packets);
+    if(ends != small_ends)
+        kvfree(ends);
+    kfree(tail);
+    mutex_unlock(&file->lock);
     return retval;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 {
     loff_t retval = 0;
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_dev *dev = aesd_filp_dev(filp);
 
     PDEBUG("seeking %lld bytes with whence %i", offset, whence);
 
-    if(mutex_lock_interruptible(&dev->lock))
+    if(aesd_lock(dev))
         return -ERESTARTSYS;
     retval = fixed_size_llseek(filp, offset, whence, dev->buffer.size);
-    mutex_unlock(&dev->lock);
+    if(retval >= 0)
+        aesd_mark_seen(dev, filp->private_data);
+    aesd_unlock(dev);
+
+    if(retval >= 0)
+        trace_aesd_seek(dev->minor, retval);
 
     return retval;
 }
 
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_dev *dev = aesd_filp_dev(filp);
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &dev->readq, wait);
+
+    if(aesd_data_available(dev, filp->private_data, filp->f_pos))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    return mask;
+}
+
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = aesd_filp_dev(filp);
+
+    PDEBUG("mmap %lu bytes at page offset %lu", vma->vm_end - vma->vm_start, vma->vm_pgoff);
+
+    if(!dev->ring)
+        return -ENODEV;
+
+    // the history is read-only, also refuse a later mprotect(PROT_WRITE)
+    if(vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    return remap_vmalloc_range(vma, dev->ring, vma->vm_pgoff);
+}
+
+/**
+ * @return the number of entries stored in @param buffer.  Must be called with the device lock held.
+ */
+static uint32_t aesd_entry_count(struct aesd_circular_buffer *buffer)
+{
+    if(buffer->full)
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+    return (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs) %
+            AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
 static long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset)
 {
     long retval = -EINVAL;
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_dev *dev = aesd_filp_dev(filp);
     struct aesd_buffer_entry add_entry;
     int rel_index = 0;
 
     PDEBUG("adjusting f_pos to %i relative index and command offset %i", write_cmd, write_cmd_offset);
 
-    if(mutex_lock_interruptible(&dev->lock))
+    if(write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        return -EINVAL;
+
+    if(aesd_lock(dev))
         return -ERESTARTSYS;
 
     rel_index = dev->buffer.out_offs + write_cmd;
@@ -213,10 +811,372 @@ static long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint3
         filp->f_pos += dev->buffer.entry[rel_index].size;
     }
 
+    aesd_mark_seen(dev, filp->private_data);
     retval = 0;
+    trace_aesd_seek(dev->minor, filp->f_pos);
 
 escape:
-    mutex_unlock(&dev->lock);
+    aesd_unlock(dev);
+    return retval;
+}
+
+static long aesd_append_packets(struct file *filp, struct aesd_append *append)
+{
+    long retval = 0;
+    struct aesd_dev *dev = aesd_filp_dev(filp);
+    char *kbuf = NULL;
+    char **packets = NULL;
+    size_t small_ends[32];
+    size_t *ends = small_ends;
+    size_t start;
+    long npackets = 0;
+    long i;
+
+    PDEBUG("append %llu bytes", append->size);
+
+    if(append->size == 0)
+        return -EINVAL;
+
+    if(append->size > AESD_APPEND_MAX_SIZE)
+        return -E2BIG;
+
+    kbuf = vmemdup_user(u64_to_user_ptr(append->data), append->size);
+    if(IS_ERR(kbuf))
+        return PTR_ERR(kbuf);
+
+    if(kbuf[append->size - 1] != '\n')
+    {
+        retval = -EINVAL;
+        goto escape;
+    }
+
+    npackets = aesd_frame_packets(dev, kbuf, append->size, 0, small_ends, ARRAY_SIZE(small_ends), &ends);
+    if(npackets < 0)
+    {
+        retval = npackets;
+        npackets = 0;
+        goto escape;
+    }
+
+    // arena mode copies straight out of kbuf, no per entry allocation needed
+    if(!dev->arena)
+    {
+        packets = kvcalloc(npackets, sizeof(*packets), GFP_KERNEL);
+        if(!packets)
+        {
+            retval = -ENOMEM;
+            goto escape;
+        }
+
+        // allocate every entry up front so nothing is committed unless all of them can be
+        for(i = 0, start = 0; i < npackets; start = ends[i++])
+        {
+            packets[i] = kmemdup(kbuf + start, ends[i] - start, GFP_KERNEL);
+            if(!packets[i])
+            {
+                retval = -ENOMEM;
+                goto escape;
+            }
+        }
+    }
+
+    if(aesd_lock(dev))
+    {
+        retval = -ERESTARTSYS;
+        goto escape;
+    }
+
+    aesd_commit_packets(dev, kbuf, packets, ends, npackets);
+    aesd_unlock(dev);
+
+    append->entries = npackets;
+
+escape:
+    if(packets)
+    {
+        for(i = 0; i < npackets; i++)
+            kfree(packets[i]);
+    }
+    kvfree(packets);
+    if(ends != small_ends)
+        kvfree(ends);
+    kvfree(kbuf);
+    return retval;
+}
+
+static long aesd_read_entries(struct file *filp, struct aesd_read_entries *request)
+{
+    long retval = 0;
+    struct aesd_dev *dev = aesd_filp_dev(filp);
+    char __user *data = u64_to_user_ptr(request->data);
+    uint32_t __user *lengths = u64_to_user_ptr(request->lengths);
+    struct aesd_buffer_entry *entry;
+    uint64_t copied = 0;
+    uint32_t stored;
+    uint32_t i;
+
+    PDEBUG("read %u entries from command %u", request->count, request->first_cmd);
+
+    request->entries = 0;
+
+    if(aesd_lock(dev))
+        return -ERESTARTSYS;
+
+    stored = aesd_entry_count(&dev->buffer);
+    if(request->first_cmd >= stored)
+    {
+        retval = -EINVAL;
+        goto escape;
+    }
+
+    for(i = 0; i < request->count && request->first_cmd + i < stored; i++)
+    {
+        entry = &dev->buffer.entry[(dev->buffer.out_offs + request->first_cmd + i) %
+                AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+
+        if(put_user((uint32_t)entry->size, &lengths[i]))
+        {
+            retval = -EFAULT;
+            goto escape;
+        }
+
+        if(entry->size > request->size - copied)
+            break;
+
+        if(copy_to_user(data + copied, entry->buffptr, entry->size))
+        {
+            retval = -EFAULT;
+            goto escape;
+        }
+
+        copied += entry->size;
+        request->entries++;
+    }
+
+escape:
+    aesd_unlock(dev);
+    return retval;
+}
+
+/**
+ * Fills @param range from the stored entries.  Must be called with the device lock held.
+ */
+static void aesd_get_seq_range(struct aesd_dev *dev, struct aesd_seq_range *range)
+{
+    uint32_t stored = aesd_entry_count(&dev->buffer);
+
+    range->oldest = dev->next_seq - stored;
+    range->newest = dev->next_seq - 1;
+}
+
+static long aesd_seek_to_seq(struct file *filp, uint64_t seq, uint32_t offset)
+{
+    long retval = 0;
+    struct aesd_dev *dev = aesd_filp_dev(filp);
+    struct aesd_seq_range range;
+    struct aesd_buffer_entry *entry;
+    loff_t pos = 0;
+    uint64_t i;
+
+    PDEBUG("seeking to sequence %llu offset %u", seq, offset);
+
+    if(aesd_lock(dev))
+        return -ERESTARTSYS;
+
+    aesd_get_seq_range(dev, &range);
+
+    if(seq < range.oldest)
+    {
+        retval = -ESTALE;
+        goto escape;
+    }
+
+    if(seq > range.newest + 1 || (seq == range.newest + 1 && offset != 0))
+    {
+        retval = -EINVAL;
+        goto escape;
+    }
+
+    // the stored sequence numbers are contiguous, so seq - oldest is the write command index
+    for(i = 0; i < seq - range.oldest; i++)
+    {
+        entry = &dev->buffer.entry[(dev->buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        pos += entry->size;
+    }
+
+    if(seq <= range.newest)
+    {
+        entry = &dev->buffer.entry[(dev->buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        if(offset >= entry->size)
+        {
+            retval = -EINVAL;
+            goto escape;
+        }
+    }
+
+    filp->f_pos = pos + offset;
+    aesd_mark_seen(dev, filp->private_data);
+    trace_aesd_seek(dev->minor, filp->f_pos);
+
+escape:
+    aesd_unlock(dev);
+    return retval;
+}
+
+static long aesd_snapshot(struct file *filp, struct aesd_snapshot *snapshot)
+{
+    long retval = 0;
+    struct aesd_dev *dev = aesd_filp_dev(filp);
+    char __user *data = u64_to_user_ptr(snapshot->data);
+    struct aesd_snapshot_header header;
+    struct aesd_snapshot_entry entry_header;
+    struct aesd_buffer_entry *entry;
+    uint64_t offset;
+    uint32_t stored;
+    uint32_t i;
+
+    if(aesd_lock(dev))
+        return -ERESTARTSYS;
+
+    stored = aesd_entry_count(&dev->buffer);
+
+    snapshot->needed = sizeof(header) + stored * sizeof(entry_header) + dev->buffer.size;
+    if(snapshot->size < snapshot->needed)
+    {
+        retval = -ENOSPC;
+        goto escape;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = AESD_SNAPSHOT_MAGIC;
+    header.version = AESD_SNAPSHOT_VERSION;
+    header.next_seq = dev->next_seq;
+    header.count = stored;
+
+    if(copy_to_user(data, &header, sizeof(header)))
+    {
+        retval = -EFAULT;
+        goto escape;
+    }
+    offset = sizeof(header);
+
+    for(i = 0; i < stored; i++)
+    {
+        entry = &dev->buffer.entry[(dev->buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+
+        memset(&entry_header, 0, sizeof(entry_header));
+        entry_header.seq = entry->seq;
+        entry_header.timestamp_ns = entry->timestamp_ns;
+        entry_header.size = entry->size;
+
+        if(copy_to_user(data + offset, &entry_header, sizeof(entry_header)) ||
+                copy_to_user(data + offset + sizeof(entry_header), entry->buffptr, entry->size))
+        {
+            retval = -EFAULT;
+            goto escape;
+        }
+        offset += sizeof(entry_header) + entry->size;
+    }
+
+escape:
+    aesd_unlock(dev);
+    return retval;
+}
+
+static long aesd_restore(struct file *filp, struct aesd_snapshot *snapshot)
+{
+    long retval = 0;
+    struct aesd_dev *dev = aesd_filp_dev(filp);
+    char *kbuf = NULL;
+    struct aesd_snapshot_header *header;
+    struct aesd_snapshot_entry *entry_headers[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    char *payloads[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED] = { NULL };
+    uint64_t offset;
+    uint32_t i;
+
+    if(snapshot->size < sizeof(*header) || snapshot->size > AESD_SNAPSHOT_MAX_SIZE)
+        return -EINVAL;
+
+    kbuf = vmemdup_user(u64_to_user_ptr(snapshot->data), snapshot->size);
+    if(IS_ERR(kbuf))
+        return PTR_ERR(kbuf);
+
+    header = (struct aesd_snapshot_header *)kbuf;
+    if(header->magic != AESD_SNAPSHOT_MAGIC || header->version != AESD_SNAPSHOT_VERSION ||
+            header->count > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED || header->next_seq < header->count + 1)
+    {
+        retval = -EINVAL;
+        goto escape;
+    }
+
+    // validate the whole dump and stage the payloads before touching the device
+    offset = sizeof(*header);
+    for(i = 0; i < header->count; i++)
+    {
+        if(snapshot->size - offset < sizeof(struct aesd_snapshot_entry))
+        {
+            retval = -EINVAL;
+            goto escape;
+        }
+        entry_headers[i] = (struct aesd_snapshot_entry *)(kbuf + offset);
+        offset += sizeof(struct aesd_snapshot_entry);
+
+        if(entry_headers[i]->size == 0 || snapshot->size - offset < entry_headers[i]->size ||
+                entry_headers[i]->seq != header->next_seq - header->count + i ||
+                (dev->arena && entry_headers[i]->size > dev->ring_size))
+        {
+            retval = -EINVAL;
+            goto escape;
+        }
+
+        if(dev->arena)
+        {
+            payloads[i] = kbuf + offset;
+        }
+        else
+        {
+            payloads[i] = kmemdup(kbuf + offset, entry_headers[i]->size, GFP_KERNEL);
+            if(!payloads[i])
+            {
+                retval = -ENOMEM;
+                goto escape;
+            }
+        }
+        offset += entry_headers[i]->size;
+    }
+
+    if(aesd_lock(dev))
+    {
+        retval = -ERESTARTSYS;
+        goto escape;
+    }
+
+    // only a freshly loaded device can be restored, merging histories would break sequence order
+    if(aesd_entry_count(&dev->buffer) != 0 || dev->next_seq != 1)
+    {
+        aesd_unlock(dev);
+        retval = -EBUSY;
+        goto escape;
+    }
+
+    for(i = 0; i < header->count; i++)
+    {
+        aesd_store_entry(dev, payloads[i], entry_headers[i]->size, entry_headers[i]->seq,
+                entry_headers[i]->timestamp_ns);
+        if(!dev->arena)
+            payloads[i] = NULL;
+    }
+    dev->next_seq = header->next_seq;
+
+    aesd_unlock(dev);
+
+escape:
+    if(!dev->arena)
+    {
+        for(i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+            kfree(payloads[i]);
+    }
+    kvfree(kbuf);
     return retval;
 }
 
@@ -233,6 +1193,65 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             else
                 retval = aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
             break;
+        case AESDCHAR_IOCAPPEND:
+        {
+            struct aesd_append append;
+            if(copy_from_user(&append, (const void __user *)arg, sizeof(append)) != 0)
+                return -EFAULT;
+            retval = aesd_append_packets(filp, &append);
+            if(retval == 0 && copy_to_user((void __user *)arg, &append, sizeof(append)) != 0)
+                retval = -EFAULT;
+            break;
+        }
+        case AESDCHAR_IOCREADENTRIES:
+        {
+            struct aesd_read_entries request;
+            if(copy_from_user(&request, (const void __user *)arg, sizeof(request)) != 0)
+                return -EFAULT;
+            retval = aesd_read_entries(filp, &request);
+            if(retval == 0 && copy_to_user((void __user *)arg, &request, sizeof(request)) != 0)
+                retval = -EFAULT;
+            break;
+        }
+        case AESDCHAR_IOCQSEQRANGE:
+        {
+            struct aesd_dev *dev = aesd_filp_dev(filp);
+            struct aesd_seq_range range;
+            if(aesd_lock(dev))
+                return -ERESTARTSYS;
+            aesd_get_seq_range(dev, &range);
+            aesd_unlock(dev);
+            retval = copy_to_user((void __user *)arg, &range, sizeof(range)) != 0 ? -EFAULT : 0;
+            break;
+        }
+        case AESDCHAR_IOCSEEKSEQ:
+        {
+            struct aesd_seekseq seekseq;
+            if(copy_from_user(&seekseq, (const void __user *)arg, sizeof(seekseq)) != 0)
+                return -EFAULT;
+            retval = aesd_seek_to_seq(filp, seekseq.seq, seekseq.offset);
+            break;
+        }
+        case AESDCHAR_IOCSNAPSHOT:
+        {
+            struct aesd_snapshot snapshot;
+            if(copy_from_user(&snapshot, (const void __user *)arg, sizeof(snapshot)) != 0)
+                return -EFAULT;
+            retval = aesd_snapshot(filp, &snapshot);
+            // needed is reported back on ENOSPC too, so the caller can size its buffer
+            if((retval == 0 || retval == -ENOSPC) &&
+                    copy_to_user((void __user *)arg, &snapshot, sizeof(snapshot)) != 0)
+                retval = -EFAULT;
+            break;
+        }
+        case AESDCHAR_IOCRESTORE:
+        {
+            struct aesd_snapshot snapshot;
+            if(copy_from_user(&snapshot, (const void __user *)arg, sizeof(snapshot)) != 0)
+                return -EFAULT;
+            retval = aesd_restore(filp, &snapshot);
+            break;
+        }
         default:
             retval = -ENOTTY;
             break;
@@ -245,79 +1264,195 @@ struct file_operations aesd_fops =
 {
     .owner =            THIS_MODULE,
     .read =             aesd_read,
+    .read_iter =        aesd_read_iter,
     .write =            aesd_write,
     .open =             aesd_open,
     .release =          aesd_release,
     .llseek =           aesd_llseek,
+    .poll =             aesd_poll,
+    .mmap =             aesd_mmap,
     .unlocked_ioctl =   aesd_ioctl,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_stats_show(struct seq_file *s, void *unused)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    struct aesd_dev *dev = s->private;
+    struct aesd_stats total;
+    struct aesd_stats *cpu_stats;
+    int cpu;
+    int i;
+
+    memset(&total, 0, sizeof(total));
+
+    for_each_possible_cpu(cpu)
+    {
+        cpu_stats = per_cpu_ptr(dev->stats, cpu);
+        total.bytes_written += cpu_stats->bytes_written;
+        total.entries_written += cpu_stats->entries_written;
+        total.bytes_read += cpu_stats->bytes_read;
+        total.evictions += cpu_stats->evictions;
+        total.partial_bytes += cpu_stats->partial_bytes;
+        total.lock_contended += cpu_stats->lock_contended;
+        for(i = 0; i < AESD_HIST_BUCKETS; i++)
+        {
+            total.lock_wait_hist[i] += cpu_stats->lock_wait_hist[i];
+            total.lock_hold_hist[i] += cpu_stats->lock_hold_hist[i];
+        }
+    }
+
+    seq_printf(s, "bytes_written %llu\n", total.bytes_written);
+    seq_printf(s, "entries_written %llu\n", total.entries_written);
+    seq_printf(s, "bytes_read %llu\n", total.bytes_read);
+    seq_printf(s, "evictions %llu\n", total.evictions);
+    seq_printf(s, "partial_bytes_pending %lld\n", total.partial_bytes);
+    seq_printf(s, "lock_contended %llu\n", total.lock_contended);
+
+    seq_puts(s, "lock_wait_us");
+    for(i = 0; i < AESD_HIST_BUCKETS; i++)
+        seq_printf(s, " %llu", total.lock_wait_hist[i]);
+    seq_puts(s, "\nlock_hold_us");
+    for(i = 0; i < AESD_HIST_BUCKETS; i++)
+        seq_printf(s, " %llu", total.lock_hold_hist[i]);
+    seq_putc(s, '\n');
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
+{
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %u", err, index);
     }
     return err;
 }
 
+/**
+ * Frees everything owned by @param dev except its cdev, which must already be removed
+ */
+static void aesd_free_dev(struct aesd_dev *dev)
+{
+    uint32_t index;
+    struct aesd_buffer_entry *entry;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, index)
+    {
+        if(entry->buffptr && !dev->arena)
+        {
+            kfree(entry->buffptr);
+            entry->buffptr = NULL;
+            entry->size = 0;
+        }
+    }
+
+    vfree(dev->ring);
+    dev->ring = NULL;
+
+    free_percpu(dev->stats);
+    dev->stats = NULL;
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    unsigned int i;
+
+    if(aesd_nr_devs == 0)
+        return -EINVAL;
+
+    if(aesd_arena && !aesd_ring_size) {
+        printk(KERN_WARNING "aesdchar: arena requires ring_size\n");
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    aesd_circular_buffer_init(&aesd_device.buffer);
-    mutex_init(&aesd_device.lock);
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if(!aesd_devices) {
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return -ENOMEM;
+    }
+
+    // debugfs is best effort, the driver works without it
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+
+    for(i = 0; i < aesd_nr_devs; i++)
+    {
+        char name[16];
+
+        aesd_circular_buffer_init(&aesd_devices[i].buffer);
+        aesd_devices[i].next_seq = 1;
+        aesd_devices[i].minor = aesd_minor + i;
+        mutex_init(&aesd_devices[i].lock);
+        init_waitqueue_head(&aesd_devices[i].readq);
+
+        aesd_devices[i].stats = alloc_percpu(struct aesd_stats);
+        if(!aesd_devices[i].stats) {
+            result = -ENOMEM;
+            goto fail;
+        }
+
+        result = aesd_ring_init(&aesd_devices[i]);
+        if( result ) {
+            aesd_free_dev(&aesd_devices[i]);
+            goto fail;
+        }
+
+        snprintf(name, sizeof(name), "aesdchar%u", i);
+        debugfs_create_file(name, 0444, aesd_debugfs_root, &aesd_devices[i], &aesd_stats_fops);
 
-    result = aesd_setup_cdev(&aesd_device);
+        result = aesd_setup_cdev(&aesd_devices[i], i);
+        if( result ) {
+            aesd_free_dev(&aesd_devices[i]);
+            goto fail;
+        }
+    }
+
+    return 0;
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+fail:
+    debugfs_remove_recursive(aesd_debugfs_root);
+    while(i-- > 0)
+    {
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_free_dev(&aesd_devices[i]);
     }
+    kfree(aesd_devices);
+    aesd_devices = NULL;
+    unregister_chrdev_region(dev, aesd_nr_devs);
     return result;
-
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    unsigned int i;
 
-    cdev_del(&aesd_device.cdev);
-
-    int index;
-    struct aesd_buffer_entry *entry;
+    debugfs_remove_recursive(aesd_debugfs_root);
 
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index)
+    for(i = 0; i < aesd_nr_devs; i++)
     {
-        if(entry->buffptr)
-        {
-            kfree(entry->buffptr);
-            entry->buffptr = NULL;
-            entry->size = 0;
-        }
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_free_dev(&aesd_devices[i]);
     }
 
-    if(aesd_device.partial_write)
-    {
-        kfree(aesd_device.partial_write);
-        aesd_device.partial_write = NULL;
-        aesd_device.partial_write_size = 0;
-    }
+    kfree(aesd_devices);
+    aesd_devices = NULL;
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 module_init(aesd_init_module);
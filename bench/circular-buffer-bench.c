@@ -0,0 +1,187 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Microbenchmarks for aesd_circular_buffer_add_entry and
+ * aesd_circular_buffer_find_entry_offset_for_fpos
+ *
+ * Built once per capacity by overriding AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, see the Makefile.
+ * Prints one CSV row per benchmark:
+ *   benchmark,capacity,entry_size,pattern,ops,ns_per_op,p50_ns,p99_ns
+ * where p50_ns and p99_ns are per operation latencies measured over batches of BATCH operations.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define BATCH 64
+
+static volatile size_t sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// small xorshift generator, the same sequence on every run
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void report(const char *benchmark, size_t entry_size, const char *pattern,
+            uint64_t *batch_ns, size_t batches, uint64_t total_ns)
+{
+    size_t ops = batches * BATCH;
+
+    qsort(batch_ns, batches, sizeof(uint64_t), compare_u64);
+    printf("%s,%d,%zu,%s,%zu,%.2f,%.2f,%.2f\n", benchmark, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+            entry_size, pattern, ops, (double)total_ns / ops,
+            (double)batch_ns[batches / 2] / BATCH, (double)batch_ns[batches * 99 / 100] / BATCH);
+}
+
+static void fill(struct aesd_circular_buffer *buffer, const char *data, size_t entry_size)
+{
+    struct aesd_buffer_entry entry = { .buffptr = data, .size = entry_size };
+    int i;
+
+    aesd_circular_buffer_init(buffer);
+    for(i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+        aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+static void bench_add(const char *data, size_t entry_size, uint64_t *batch_ns, size_t batches)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry = { .buffptr = data, .size = entry_size };
+    uint64_t start, total = 0;
+    size_t b, i;
+
+    fill(&buffer, data, entry_size);
+
+    for(b = 0; b < batches; b++)
+    {
+        start = now_ns();
+        for(i = 0; i < BATCH; i++)
+            aesd_circular_buffer_add_entry(&buffer, &entry);
+        batch_ns[b] = now_ns() - start;
+        total += batch_ns[b];
+    }
+    sink += buffer.size;
+
+    report("add_entry", entry_size, "steady_full", batch_ns, batches, total);
+}
+
+static void bench_find(const char *data, size_t entry_size, const char *pattern,
+            uint64_t *batch_ns, size_t batches)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset = 0;
+    size_t *offsets;
+    uint64_t state = 88172645463325252ull;
+    uint64_t start, total = 0;
+    size_t b, i, pos = 0;
+    // a reader draining the buffer with read(2) calls of this size
+    const size_t read_chunk = 512;
+
+    fill(&buffer, data, entry_size);
+
+    // precompute the offsets so only the lookup is timed
+    offsets = malloc(batches * BATCH * sizeof(size_t));
+    if(!offsets)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    for(i = 0; i < batches * BATCH; i++)
+    {
+        if(strcmp(pattern, "sequential") == 0)
+        {
+            offsets[i] = pos;
+            pos = (pos + read_chunk < buffer.size) ? pos + read_chunk : 0;
+        }
+        else
+        {
+            offsets[i] = next_random(&state) % buffer.size;
+        }
+    }
+
+    for(b = 0; b < batches; b++)
+    {
+        start = now_ns();
+        for(i = 0; i < BATCH; i++)
+        {
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[b * BATCH + i], &entry_offset);
+            sink += entry_offset + (entry != NULL);
+        }
+        batch_ns[b] = now_ns() - start;
+        total += batch_ns[b];
+    }
+
+    free(offsets);
+    report("find_entry_offset_for_fpos", entry_size, pattern, batch_ns, batches, total);
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t entry_sizes[] = { 16, 256, 4096 };
+    size_t batches = 20000;
+    uint64_t *batch_ns;
+    char *data;
+    size_t i;
+    int opt;
+
+    while((opt = getopt(argc, argv, "Hb:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H':
+                printf("benchmark,capacity,entry_size,pattern,ops,ns_per_op,p50_ns,p99_ns\n");
+                break;
+            case 'b':
+                batches = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-H] [-b batches]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if(batches == 0)
+        batches = 1;
+
+    batch_ns = malloc(batches * sizeof(uint64_t));
+    data = malloc(entry_sizes[sizeof(entry_sizes) / sizeof(entry_sizes[0]) - 1]);
+    if(!batch_ns || !data)
+    {
+        perror("malloc");
+        return 1;
+    }
+    memset(data, 'x', entry_sizes[sizeof(entry_sizes) / sizeof(entry_sizes[0]) - 1]);
+
+    for(i = 0; i < sizeof(entry_sizes) / sizeof(entry_sizes[0]); i++)
+    {
+        bench_add(data, entry_sizes[i], batch_ns, batches);
+        bench_find(data, entry_sizes[i], "sequential", batch_ns, batches);
+        bench_find(data, entry_sizes[i], "random", batch_ns, batches);
+    }
+
+    free(batch_ns);
+    free(data);
+    return 0;
+}
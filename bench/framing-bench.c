@@ -0,0 +1,178 @@
+/**
+ * @file framing-bench.c
+ * @brief Benchmarks aesd_framing_find_ends against memchr based newline framing
+ *
+ * A 1 MiB stream of packet_size byte packets is fed in fragment_size byte pieces, the way
+ * aesd_write and aesdsocket see it, and every packet end is located with one of:
+ *   rescan_memchr  memchr over the whole accumulated partial packet on every fragment,
+ *                  then once more per packet to split it (the original aesd_write)
+ *   memchr         memchr over the new bytes only, once per packet
+ *   framing        aesd_framing_find_ends over the new bytes only
+ * Prints one CSV row per combination:
+ *   benchmark,packet_size,fragment_size,method,bytes,packets,ns_per_byte,gb_per_s
+ * where the time is the median of the runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "../aesd-char-driver/aesd-framing.h"
+
+#define STREAM_SIZE (1024 * 1024)
+
+enum method
+{
+    RESCAN_MEMCHR,
+    MEMCHR,
+    FRAMING,
+};
+
+static const char *method_names[] = { "rescan_memchr", "memchr", "framing" };
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// count the packets memchr finds in [start, end), @return the end of the last one or start
+static const char *memchr_packets(const char *start, const char *end, size_t *packets)
+{
+    const char *newline;
+    const char *last = start;
+
+    while(start < end && (newline = memchr(start, '\n', end - start)) != NULL)
+    {
+        (*packets)++;
+        last = start = newline + 1;
+    }
+    return last;
+}
+
+// feed the stream in fragments, @return the number of packets found
+static size_t frame_stream(enum method method, const char *stream, size_t fragment_size)
+{
+    const char *partial = stream;
+    size_t ends[64];
+    size_t packets = 0;
+    size_t pos, count, found, scanned;
+
+    for(pos = 0; pos < STREAM_SIZE; pos += count)
+    {
+        count = (STREAM_SIZE - pos < fragment_size) ? STREAM_SIZE - pos : fragment_size;
+
+        switch(method)
+        {
+            case RESCAN_MEMCHR:
+                if(memchr(partial, '\n', stream + pos + count - partial) != NULL)
+                    partial = memchr_packets(partial, stream + pos + count, &packets);
+                break;
+            case MEMCHR:
+                memchr_packets(stream + pos, stream + pos + count, &packets);
+                break;
+            case FRAMING:
+                scanned = 0;
+                do
+                {
+                    found = aesd_framing_find_ends(stream + pos + scanned, count - scanned, ends,
+                            sizeof(ends) / sizeof(ends[0]));
+                    packets += found;
+                    if(found > 0)
+                        scanned += ends[found - 1];
+                } while(found == sizeof(ends) / sizeof(ends[0]));
+                break;
+        }
+    }
+
+    return packets;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t packet_sizes[] = { 64, 4096, STREAM_SIZE };
+    static const size_t fragment_sizes[] = { 7, 512, STREAM_SIZE };
+    size_t runs = 20;
+    uint64_t *run_ns;
+    char *stream;
+    size_t p, f, m, r, i, packets = 0;
+    uint64_t start;
+    int opt;
+
+    while((opt = getopt(argc, argv, "Hr:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H':
+                printf("benchmark,packet_size,fragment_size,method,bytes,packets,ns_per_byte,gb_per_s\n");
+                break;
+            case 'r':
+                runs = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-H] [-r runs]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if(runs == 0)
+        runs = 1;
+
+    run_ns = malloc(runs * sizeof(uint64_t));
+    stream = malloc(STREAM_SIZE);
+    if(!run_ns || !stream)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    for(p = 0; p < sizeof(packet_sizes) / sizeof(packet_sizes[0]); p++)
+    {
+        memset(stream, 'x', STREAM_SIZE);
+        for(i = packet_sizes[p] - 1; i < STREAM_SIZE; i += packet_sizes[p])
+            stream[i] = '\n';
+
+        for(f = 0; f < sizeof(fragment_sizes) / sizeof(fragment_sizes[0]); f++)
+        {
+            for(m = RESCAN_MEMCHR; m <= FRAMING; m++)
+            {
+                // a whole packet per fragment is the worst case for rescanning, skip the minutes long runs
+                if(m == RESCAN_MEMCHR && fragment_sizes[f] < 64 && packet_sizes[p] == STREAM_SIZE)
+                    continue;
+
+                for(r = 0; r < runs; r++)
+                {
+                    start = now_ns();
+                    packets = frame_stream(m, stream, fragment_sizes[f]);
+                    run_ns[r] = now_ns() - start;
+                }
+
+                if(packets != STREAM_SIZE / packet_sizes[p])
+                {
+                    fprintf(stderr, "%s found %zu packets, expected %zu\n", method_names[m],
+                            packets, STREAM_SIZE / packet_sizes[p]);
+                    return 1;
+                }
+
+                qsort(run_ns, runs, sizeof(uint64_t), compare_u64);
+                printf("framing,%zu,%zu,%s,%d,%zu,%.3f,%.2f\n", packet_sizes[p], fragment_sizes[f],
+                        method_names[m], STREAM_SIZE, packets, (double)run_ns[runs / 2] / STREAM_SIZE,
+                        (double)STREAM_SIZE / run_ns[runs / 2]);
+            }
+        }
+    }
+
+    free(run_ns);
+    free(stream);
+    return 0;
+}
@@ -0,0 +1,304 @@
+/**
+ * @file lock-bench.c
+ * @brief Measures lock contention with threads from start_thread_obtaining_lock
+ *
+ * For each thread count and lock kind, starts that many threads on one shared lock.  Each
+ * thread runs the same number of iterations, waiting outside the lock and then holding it for
+ * times drawn from the configured distributions, and records how long every acquisition took:
+ *   mutex     default pthread mutex
+ *   adaptive  pthread mutex that spins before sleeping (a plain mutex outside glibc)
+ *   spin      pthread spinlock
+ *   ticket    FIFO ticket lock
+ * Prints one CSV row per combination:
+ *   benchmark,lock,threads,hold,wait,acquisitions,ops_per_s,mean_ns,p50_ns,p99_ns,max_ns,histogram
+ * where histogram lists the non-empty power of two latency buckets as upper_bound_ns:count,
+ * separated by '|'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "../examples/threading/threading.h"
+
+#define MAX_LIST 16
+#define HISTOGRAM_BUCKETS 64
+
+enum distribution
+{
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_EXP,
+};
+
+struct wait_spec
+{
+    enum distribution dist;
+    uint32_t mean_ns;
+    const char *text;
+};
+
+static const struct
+{
+    const char *name;
+    enum thread_lock_kind kind;
+} locks[] = {
+    { "mutex", THREAD_LOCK_MUTEX },
+    { "adaptive", THREAD_LOCK_ADAPTIVE },
+    { "spin", THREAD_LOCK_SPIN },
+    { "ticket", THREAD_LOCK_TICKET },
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Parses "fixed:ns", "uniform:ns" or "exp:ns", a bare number meaning fixed.
+ * uniform draws from [0, 2 * ns], exp from an exponential distribution with mean ns.
+ */
+static bool parse_wait(char *arg, struct wait_spec *spec)
+{
+    char *colon = strchr(arg, ':');
+
+    spec->text = arg;
+    spec->dist = DIST_FIXED;
+    if(colon)
+    {
+        *colon = '\0';
+        if(strcmp(arg, "uniform") == 0)
+            spec->dist = DIST_UNIFORM;
+        else if(strcmp(arg, "exp") == 0)
+            spec->dist = DIST_EXP;
+        else if(strcmp(arg, "fixed") != 0)
+            return false;
+        *colon = ':';
+        arg = colon + 1;
+    }
+    spec->mean_ns = strtoul(arg, NULL, 0);
+    return true;
+}
+
+// drawn up front so the random number generator stays out of the timed loop
+static void fill_waits(uint32_t *waits, size_t count, const struct wait_spec *spec, unsigned int *seed)
+{
+    double u;
+    size_t i;
+
+    for(i = 0; i < count; i++)
+    {
+        switch(spec->dist)
+        {
+            case DIST_FIXED:
+                waits[i] = spec->mean_ns;
+                break;
+            case DIST_UNIFORM:
+                waits[i] = (uint64_t)rand_r(seed) * 2 * spec->mean_ns / RAND_MAX;
+                break;
+            case DIST_EXP:
+                u = ((double)rand_r(seed) + 1) / ((double)RAND_MAX + 2);
+                waits[i] = -log(u) * spec->mean_ns;
+                break;
+        }
+    }
+}
+
+static void report(const char *lock, size_t threads, const struct wait_spec *hold,
+        const struct wait_spec *wait, uint64_t *latency_ns, size_t count, uint64_t elapsed_ns)
+{
+    size_t histogram[HISTOGRAM_BUCKETS] = { 0 };
+    const char *separator = "";
+    uint64_t total = 0;
+    size_t i;
+    int bucket;
+
+    for(i = 0; i < count; i++)
+    {
+        total += latency_ns[i];
+        bucket = latency_ns[i] ? 64 - __builtin_clzll(latency_ns[i]) : 0;
+        histogram[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1]++;
+    }
+
+    qsort(latency_ns, count, sizeof(uint64_t), compare_u64);
+    printf("locks,%s,%zu,%s,%s,%zu,%.0f,%.1f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",", lock, threads,
+            hold->text, wait->text, count, count / ((double)elapsed_ns / 1e9), (double)total / count,
+            latency_ns[count / 2], latency_ns[count * 99 / 100], latency_ns[count - 1]);
+    for(bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        if(histogram[bucket])
+        {
+            printf("%s%llu:%zu", separator, 1ull << bucket, histogram[bucket]);
+            separator = "|";
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t thread_list[MAX_LIST] = { 1, 2, 4, 8 };
+    size_t nthreads = 4;
+    size_t lock_list[MAX_LIST] = { 0, 1, 2, 3 };
+    size_t nlocks = sizeof(locks) / sizeof(locks[0]);
+    size_t iterations = 20000;
+    char hold_default[] = "fixed:1000";
+    char wait_default[] = "exp:4000";
+    struct wait_spec hold, wait;
+    struct thread_data params = { 0 };
+    struct thread_data *result;
+    struct thread_lock lock;
+    pthread_barrier_t start;
+    pthread_t *threads;
+    uint32_t *obtain_ns, *release_ns;
+    uint64_t *latency_ns;
+    uint64_t begin;
+    unsigned int seed;
+    size_t t, l, i, n, started, max_threads = 0;
+    bool ok;
+    char *arg;
+    int opt;
+
+    parse_wait(hold_default, &hold);
+    parse_wait(wait_default, &wait);
+
+    while((opt = getopt(argc, argv, "Hn:t:l:o:w:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H':
+                printf("benchmark,lock,threads,hold,wait,acquisitions,ops_per_s,mean_ns,p50_ns,p99_ns,max_ns,histogram\n");
+                break;
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                // comma separated list of thread counts
+                nthreads = 0;
+                for(arg = strtok(optarg, ","); arg && nthreads < MAX_LIST; arg = strtok(NULL, ","))
+                    thread_list[nthreads++] = strtoul(arg, NULL, 0);
+                break;
+            case 'l':
+                // comma separated list of lock names
+                nlocks = 0;
+                for(arg = strtok(optarg, ","); arg && nlocks < MAX_LIST; arg = strtok(NULL, ","))
+                {
+                    for(l = 0; l < sizeof(locks) / sizeof(locks[0]); l++)
+                        if(strcmp(arg, locks[l].name) == 0)
+                            lock_list[nlocks++] = l;
+                }
+                break;
+            case 'o':
+                if(!parse_wait(optarg, &hold))
+                    goto usage;
+                break;
+            case 'w':
+                if(!parse_wait(optarg, &wait))
+                    goto usage;
+                break;
+            default:
+                goto usage;
+        }
+    }
+
+    if(iterations == 0)
+        iterations = 1;
+    for(t = 0; t < nthreads; t++)
+    {
+        if(thread_list[t] == 0)
+            thread_list[t] = 1;
+        if(thread_list[t] > max_threads)
+            max_threads = thread_list[t];
+    }
+
+    threads = malloc(max_threads * sizeof(pthread_t));
+    obtain_ns = malloc(max_threads * iterations * sizeof(uint32_t));
+    release_ns = malloc(max_threads * iterations * sizeof(uint32_t));
+    latency_ns = malloc(max_threads * iterations * sizeof(uint64_t));
+    if(!threads || !obtain_ns || !release_ns || !latency_ns)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    // the same waits for every lock, so the locks are the only thing that differs
+    seed = 1;
+    fill_waits(obtain_ns, max_threads * iterations, &wait, &seed);
+    fill_waits(release_ns, max_threads * iterations, &hold, &seed);
+
+    params.iterations = iterations;
+    params.start = &start;
+    params.lock = &lock;
+
+    for(t = 0; t < nthreads; t++)
+    {
+        n = thread_list[t];
+        for(l = 0; l < nlocks; l++)
+        {
+            if(!thread_lock_init(&lock, locks[lock_list[l]].kind)
+                    || pthread_barrier_init(&start, NULL, n + 1) != 0)
+            {
+                fprintf(stderr, "could not create a %s lock\n", locks[lock_list[l]].name);
+                return 1;
+            }
+
+            for(started = 0; started < n; started++)
+            {
+                params.wait_to_obtain_ns = obtain_ns + started * iterations;
+                params.wait_to_release_ns = release_ns + started * iterations;
+                params.latency_ns = latency_ns + started * iterations;
+                if(!start_thread_obtaining_lock(&threads[started], &params))
+                {
+                    // the barrier can never open, there is no way to release what started
+                    fprintf(stderr, "could not start thread %zu\n", started);
+                    return 1;
+                }
+            }
+
+            begin = now_ns();
+            pthread_barrier_wait(&start);
+
+            ok = true;
+            for(i = 0; i < n; i++)
+            {
+                pthread_join(threads[i], (void **)&result);
+                ok = ok && result->thread_complete_success;
+                free(result);
+            }
+            if(!ok)
+            {
+                fprintf(stderr, "a %s thread failed\n", locks[lock_list[l]].name);
+                return 1;
+            }
+
+            report(locks[lock_list[l]].name, n, &hold, &wait, latency_ns, n * iterations, now_ns() - begin);
+            pthread_barrier_destroy(&start);
+            thread_lock_destroy(&lock);
+        }
+    }
+
+    free(threads);
+    free(obtain_ns);
+    free(release_ns);
+    free(latency_ns);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-H] [-n iterations] [-t threads,...] [-l mutex,adaptive,spin,ticket]\n"
+            "       [-o hold] [-w wait]   hold and wait are [fixed:|uniform:|exp:]ns\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,162 @@
+/**
+ * @file perf-reference.c
+ * @brief Reference measurements perf-test.sh scales benchmark results by
+ *
+ * Measures how fast this machine runs the kinds of work the benchmarks do, with code that
+ * does not change when aesdchar or aesdsocket do:
+ *   cpu,ns_per_op       one step of a dependent loop of table lookups and integer arithmetic
+ *   loopback,p50_us     median connect, send one line, read the echo until close, against
+ *                       a trivial server thread on 127.0.0.1
+ *   loopback,rps        requests per second of the same exchange
+ * Prints them as key,metric,value lines, the format perf-test.sh collects results in, so a
+ * result divided by its reference stays comparable between fast hosts, slow CI runners
+ * and emulated targets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define CPU_STEPS 20000000
+#define CPU_RUNS 3
+#define LOOPBACK_REQUESTS 300
+#define LINE "xxxxxxxxxxxxxxx\n"
+
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double cpu_ns_per_op(void)
+{
+    uint64_t table[16];
+    uint64_t state = 88172645463325252ull;
+    uint64_t start, elapsed, best = UINT64_MAX;
+    size_t i;
+    int run;
+
+    for(i = 0; i < 16; i++)
+        table[i] = i * 2654435761u;
+
+    for(run = 0; run < CPU_RUNS; run++)
+    {
+        start = now_ns();
+        for(i = 0; i < CPU_STEPS; i++)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            state += table[state & 15];
+        }
+        elapsed = now_ns() - start;
+        if(elapsed < best)
+            best = elapsed;
+    }
+
+    sink = state;
+    return (double)best / CPU_STEPS;
+}
+
+// answers every connection with the line it sent and closes it, the least a server can do
+static void *echo_server(void *arg)
+{
+    int listenfd = *(int *)arg;
+    char buf[64];
+    size_t len;
+    ssize_t received;
+    int fd;
+
+    while((fd = accept(listenfd, NULL, NULL)) != -1)
+    {
+        len = 0;
+        while(len < sizeof(buf) && (received = recv(fd, buf + len, sizeof(buf) - len, 0)) > 0)
+        {
+            len += received;
+            if(buf[len - 1] == '\n')
+                break;
+        }
+        send(fd, buf, len, MSG_NOSIGNAL);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int loopback(double *p50_us, double *rps)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t addrlen = sizeof(addr);
+    uint64_t latency_ns[LOOPBACK_REQUESTS];
+    uint64_t begin, start;
+    pthread_t server;
+    char buf[64];
+    size_t i;
+    int listenfd, fd;
+
+    // an ephemeral port, so nothing else on the machine can be in the way
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listenfd == -1 || bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+            || listen(listenfd, 16) == -1 || getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) == -1)
+        return -1;
+    if(pthread_create(&server, NULL, echo_server, &listenfd) != 0)
+        return -1;
+
+    begin = now_ns();
+    for(i = 0; i < LOOPBACK_REQUESTS; i++)
+    {
+        start = now_ns();
+        if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1
+                || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+                || send(fd, LINE, strlen(LINE), MSG_NOSIGNAL) == -1)
+            return -1;
+        while(recv(fd, buf, sizeof(buf), 0) > 0)
+            ;
+        close(fd);
+        latency_ns[i] = now_ns() - start;
+    }
+    *rps = LOOPBACK_REQUESTS / ((double)(now_ns() - begin) / 1e9);
+
+    qsort(latency_ns, LOOPBACK_REQUESTS, sizeof(uint64_t), compare_u64);
+    *p50_us = latency_ns[LOOPBACK_REQUESTS / 2] / 1e3;
+
+    // accept() fails once the socket is shut down, which ends the server thread
+    shutdown(listenfd, SHUT_RDWR);
+    pthread_join(server, NULL);
+    close(listenfd);
+    return 0;
+}
+
+int main(void)
+{
+    double p50_us, rps;
+
+    printf("cpu,ns_per_op,%.4f\n", cpu_ns_per_op());
+
+    if(loopback(&p50_us, &rps) == -1)
+    {
+        perror("loopback reference");
+        return 1;
+    }
+    printf("loopback,p50_us,%.2f\n", p50_us);
+    printf("loopback,rps,%.0f\n", rps);
+    return 0;
+}
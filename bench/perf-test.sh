@@ -0,0 +1,150 @@
+#!/bin/bash
+# Performance regression test: runs the circular buffer benchmark and a localhost aesdsocket
+# throughput and latency scenario, and compares the results with perf-baseline.csv.
+# Every run first measures perf-reference on the same machine and results are compared as
+# ratios to it, so the baselines hold on faster and slower hosts than the one they came from.
+# Usage: perf-test.sh [-u] bindir
+# bindir holds perf-reference, circular-buffer-bench, socket-bench and aesdsocket-ring, an
+# aesdsocket built with USE_AESD_RING=1, as the perf-test target of the top level
+# CMakeLists.txt builds them.  Needs no root, no aesdchar module and no interface but loopback.
+# -u rewrites the baselines with the results of this machine, keeping the tolerances.
+
+set -e
+set -u
+set -o pipefail
+cd `dirname $0`
+
+UPDATE=0
+if [ "${1:-}" = "-u" ]
+then
+	UPDATE=1
+	shift
+fi
+if [ $# -lt 1 ]
+then
+	echo "usage: $0 [-u] bindir"
+	exit 1
+fi
+BINDIR=$1
+BASELINE=${BASELINE:-perf-baseline.csv}
+# every scenario runs this many times and keeps its best result, to ride out scheduling noise
+RUNS=${RUNS:-3}
+PORT=${PORT:-9400}
+RESULTS=$(mktemp)
+PID=""
+
+cleanup()
+{
+	if [ -n "$PID" ]
+	then
+		kill $PID 2>/dev/null || true
+		wait $PID 2>/dev/null || true
+	fi
+	PID=""
+}
+trap 'cleanup; rm -f $RESULTS' EXIT
+
+# first port from $PORT on that nothing is listening on
+while (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null
+do
+	PORT=$((PORT + 1))
+done
+
+# wait until the aesdsocket on port $1 accepts connections
+wait_port()
+{
+	for i in $(seq 1 50)
+	do
+		if (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null
+		then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "nothing listening on port $1"
+	exit 1
+}
+
+# prints metric $2 of key $1 from the perf-reference output in $REFERENCE
+reference()
+{
+	echo "$REFERENCE" | awk -F, -v key=$1 -v metric=$2 '$1 == key && $2 == metric { print $3 }'
+}
+
+# results are collected as key,metric,value lines, each value divided by the reference it
+# is named after, from the same run
+for run in $(seq 1 $RUNS)
+do
+	REFERENCE=$("$BINDIR/perf-reference")
+	CPU_NS=$(reference cpu ns_per_op)
+	LOOPBACK_US=$(reference loopback p50_us)
+	LOOPBACK_RPS=$(reference loopback rps)
+
+	"$BINDIR/circular-buffer-bench" | awk -F, -v cpu=$CPU_NS '{
+		key = $1 "/" $3 "/" $4
+		print key ",ns_per_op/cpu," $6 / cpu
+	}' >> $RESULTS
+
+	# a fresh server per run, so every run sees the same history sizes
+	"$BINDIR/aesdsocket-ring" -p $PORT > /dev/null &
+	PID=$!
+	wait_port $PORT
+	"$BINDIR/socket-bench" -p $PORT -c 1,4 -n 300 | awk -F, -v us=$LOOPBACK_US -v rps=$LOOPBACK_RPS '{
+		key = "socket/" $3
+		print key ",rps/loopback," $5 / rps
+		print key ",p50_us/loopback," $7 / us
+		print key ",p99_us/loopback," $8 / us
+	}' >> $RESULTS
+	cleanup
+done
+
+# perf-baseline.csv lines are key,metric,better,baseline,tolerance.  A result fails when it
+# is worse than the baseline by more than a factor of tolerance, better being lower or higher.
+awk -F, -v update=$UPDATE -v baseline=$BASELINE '
+	FNR == NR {
+		id = $1 "," $2
+		if(!(id in lowest) || $3 < lowest[id])
+			lowest[id] = $3
+		if(!(id in highest) || $3 > highest[id])
+			highest[id] = $3
+		next
+	}
+	/^#/ || NF < 5 {
+		if(update)
+			print > baseline ".new"
+		next
+	}
+	{
+		id = $1 "," $2
+		if(!(id in lowest))
+		{
+			printf("%-45s %-18s no result\n", $1, $2)
+			failed++
+			next
+		}
+		measured = ($3 == "higher") ? highest[id] : lowest[id]
+		if(update)
+		{
+			printf("%s,%s,%s,%g,%s\n", $1, $2, $3, measured, $5) > baseline ".new"
+			next
+		}
+		bad = ($3 == "higher") ? (measured * $5 < $4) : (measured > $4 * $5)
+		printf("%-45s %-18s %10.4g baseline %10.4g x%-4s %s\n", $1, $2, measured, $4, $5, bad ? "REGRESSED" : "ok")
+		failed += bad
+	}
+	END {
+		if(update)
+			exit 0
+		if(failed)
+			printf("%d performance regression(s)\n", failed)
+		else
+			printf("no performance regressions\n")
+		exit failed != 0
+	}
+' $RESULTS $BASELINE
+
+if [ $UPDATE -eq 1 ]
+then
+	mv $BASELINE.new $BASELINE
+	echo "updated $BASELINE"
+fi
@@ -0,0 +1,247 @@
+/**
+ * @file socket-bench.c
+ * @brief Localhost load generator for aesdsocket
+ *
+ * For each concurrency level, starts that many client threads against a running aesdsocket.
+ * Every client repeatedly connects, sends one newline terminated packet and reads the
+ * history aesdsocket answers with until it closes the connection, timing each request from
+ * connect to end of file.  Prints one CSV row per concurrency level:
+ *   benchmark,profile,concurrency,requests,rps,mean_us,p50_us,p99_us,max_us
+ * where profile is only the label given with -P, so runs against differently started
+ * servers can share one table.
+ *
+ * aesdsocket answers with the whole history, so responses grow with every request;
+ * compare profiles over the same request counts against freshly started servers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_LIST 16
+#define RESPONSE_SIZE 65536
+
+struct client
+{
+    pthread_t thread;
+    const struct addrinfo *server;
+    const char *packet;
+    size_t packet_size;
+    size_t requests;
+    bool nodelay;
+    // one entry per request, filled in by the client thread
+    uint64_t *latency_ns;
+    bool failed;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static bool request(struct client *client, char *response)
+{
+    int yes = 1;
+    ssize_t len;
+    int fd;
+
+    fd = socket(client->server->ai_family, client->server->ai_socktype, client->server->ai_protocol);
+    if(fd == -1)
+        return false;
+    if(client->nodelay)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    if(connect(fd, client->server->ai_addr, client->server->ai_addrlen) == -1
+            || send(fd, client->packet, client->packet_size, MSG_NOSIGNAL) != (ssize_t)client->packet_size)
+    {
+        close(fd);
+        return false;
+    }
+
+    while((len = recv(fd, response, RESPONSE_SIZE, 0)) > 0)
+        ;
+
+    close(fd);
+    return len == 0;
+}
+
+static void *run_client(void *arg)
+{
+    struct client *client = arg;
+    char *response = malloc(RESPONSE_SIZE);
+    uint64_t start;
+    size_t i;
+
+    client->failed = (response == NULL);
+    for(i = 0; i < client->requests && !client->failed; i++)
+    {
+        start = now_ns();
+        client->failed = !request(client, response);
+        client->latency_ns[i] = now_ns() - start;
+    }
+
+    free(response);
+    return NULL;
+}
+
+static void report(const char *profile, size_t concurrency, uint64_t *latency_ns, size_t count,
+        uint64_t elapsed_ns)
+{
+    uint64_t total = 0;
+    size_t i;
+
+    for(i = 0; i < count; i++)
+        total += latency_ns[i];
+
+    qsort(latency_ns, count, sizeof(uint64_t), compare_u64);
+    printf("socket,%s,%zu,%zu,%.0f,%.1f,%.1f,%.1f,%.1f\n", profile, concurrency, count,
+            count / ((double)elapsed_ns / 1e9), (double)total / count / 1e3, latency_ns[count / 2] / 1e3,
+            latency_ns[count * 99 / 100] / 1e3, latency_ns[count - 1] / 1e3);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t concurrency_list[MAX_LIST] = { 1, 4 };
+    size_t nconcurrency = 2;
+    size_t requests = 500;
+    size_t bytes = 16;
+    size_t max_concurrency = 0;
+    const char *port = "9000";
+    const char *profile = "default";
+    bool nodelay = false;
+    struct addrinfo hints, *server;
+    struct client *clients;
+    uint64_t *latency_ns;
+    uint64_t begin;
+    char *packet;
+    char *arg;
+    size_t c, i, n;
+    bool ok;
+    int opt;
+
+    while((opt = getopt(argc, argv, "Hp:c:n:b:P:N")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H':
+                printf("benchmark,profile,concurrency,requests,rps,mean_us,p50_us,p99_us,max_us\n");
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'c':
+                // comma separated list of concurrent clients
+                nconcurrency = 0;
+                for(arg = strtok(optarg, ","); arg && nconcurrency < MAX_LIST; arg = strtok(NULL, ","))
+                    concurrency_list[nconcurrency++] = strtoul(arg, NULL, 0);
+                break;
+            case 'n':
+                requests = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                bytes = strtoul(optarg, NULL, 0);
+                break;
+            case 'P':
+                profile = optarg;
+                break;
+            case 'N':
+                nodelay = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-H] [-p port] [-c clients,...] [-n requests per client]\n"
+                        "       [-b packet bytes] [-P profile label] [-N]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if(requests == 0)
+        requests = 1;
+    if(bytes == 0)
+        bytes = 1;
+    for(c = 0; c < nconcurrency; c++)
+    {
+        if(concurrency_list[c] == 0)
+            concurrency_list[c] = 1;
+        if(concurrency_list[c] > max_concurrency)
+            max_concurrency = concurrency_list[c];
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo("127.0.0.1", port, &hints, &server) != 0)
+    {
+        fprintf(stderr, "bad port %s\n", port);
+        return 1;
+    }
+
+    packet = malloc(bytes);
+    clients = calloc(max_concurrency, sizeof(struct client));
+    latency_ns = malloc(max_concurrency * requests * sizeof(uint64_t));
+    if(!packet || !clients || !latency_ns)
+    {
+        perror("malloc");
+        return 1;
+    }
+    memset(packet, 'x', bytes - 1);
+    packet[bytes - 1] = '\n';
+
+    for(c = 0; c < nconcurrency; c++)
+    {
+        n = concurrency_list[c];
+        begin = now_ns();
+        for(i = 0; i < n; i++)
+        {
+            clients[i].server = server;
+            clients[i].packet = packet;
+            clients[i].packet_size = bytes;
+            clients[i].requests = requests;
+            clients[i].nodelay = nodelay;
+            clients[i].latency_ns = latency_ns + i * requests;
+            if(pthread_create(&clients[i].thread, NULL, run_client, &clients[i]) != 0)
+            {
+                fprintf(stderr, "could not start client %zu\n", i);
+                return 1;
+            }
+        }
+
+        ok = true;
+        for(i = 0; i < n; i++)
+        {
+            pthread_join(clients[i].thread, NULL);
+            ok = ok && !clients[i].failed;
+        }
+        if(!ok)
+        {
+            fprintf(stderr, "a request to port %s failed, is aesdsocket running?\n", port);
+            return 1;
+        }
+
+        report(profile, n, latency_ns, n * requests, now_ns() - begin);
+    }
+
+    freeaddrinfo(server);
+    free(packet);
+    free(clients);
+    free(latency_ns);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#!/bin/bash
+# Compares request latency of aesdsocket's default and low-latency (-l) profiles on localhost.
+# Starts a fresh server for every profile so each run sees the same history sizes, and prints
+# one CSV table of socket-bench results.
+# Usage: socket-bench.sh [aesdsocket] [socket-bench arguments...]
+# aesdsocket defaults to ../server/aesdsocket; build it with "make USE_AESD_RING=1" so the
+# history is kept in memory and neither /dev/aesdchar nor disk writes get measured.
+# Set CPUS, e.g. CPUS=2-5, to also pin the low-latency server with -c, and SPIN_US to have
+# it spin that long before blocking with -w.  Both want spare cores, on a machine with one
+# or two the spinning server only takes CPU time away from the load generator.
+
+set -e
+set -u
+cd `dirname $0`
+
+AESDSOCKET=${1:-../server/aesdsocket}
+[ $# -gt 0 ] && shift
+PORT=${PORT:-9300}
+CPUS=${CPUS:-}
+SPIN_US=${SPIN_US:-}
+PID=""
+
+cleanup()
+{
+	if [ -n "$PID" ]
+	then
+		kill $PID 2>/dev/null || true
+		wait $PID 2>/dev/null || true
+	fi
+	PID=""
+}
+trap cleanup EXIT
+
+# wait until the aesdsocket on port $1 accepts connections
+wait_port()
+{
+	for i in $(seq 1 50)
+	do
+		if (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null
+		then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "nothing listening on port $1"
+	exit 1
+}
+
+# run socket-bench with profile label $1 against an aesdsocket started with the remaining
+# arguments, printing the CSV header before the first profile only
+HEADER=-H
+run_profile()
+{
+	local profile=$1
+	shift
+	"$AESDSOCKET" -p $PORT "$@" > /dev/null &
+	PID=$!
+	wait_port $PORT
+	./socket-bench $HEADER -p $PORT -P $profile "${BENCH_ARGS[@]}"
+	HEADER=
+	cleanup
+}
+
+BENCH_ARGS=("$@")
+run_profile default
+run_profile low-latency -l ${CPUS:+-c $CPUS} ${SPIN_US:+-w $SPIN_US}
@@ -0,0 +1,164 @@
+/**
+ * @file spawn-bench.c
+ * @brief Measures command launch latency against the size of the launching process
+ *
+ * For each resident set size the process first touches that many MiB of heap, then times
+ * launching and reaping /bin/true with:
+ *   fork_execv  fork() + execv() + waitpid(), the way do_exec() used to work
+ *   do_exec     do_exec() from examples/systemcalls, built on posix_spawn()
+ * Prints one CSV row per combination:
+ *   benchmark,rss_mib,method,runs,mean_us,p50_us,p99_us
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "../examples/systemcalls/systemcalls.h"
+
+#define COMMAND "/bin/true"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static bool fork_execv(void)
+{
+    char *argv[] = { COMMAND, NULL };
+    int status;
+    pid_t pid = fork();
+
+    if(pid == -1)
+        return false;
+    if(pid == 0)
+    {
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if(waitpid(pid, &status, 0) == -1)
+        return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool spawn(void)
+{
+    return do_exec(1, COMMAND);
+}
+
+static void report(size_t rss_mib, const char *method, uint64_t *run_ns, size_t runs)
+{
+    uint64_t total = 0;
+    size_t i;
+
+    for(i = 0; i < runs; i++)
+        total += run_ns[i];
+
+    qsort(run_ns, runs, sizeof(uint64_t), compare_u64);
+    printf("spawn,%zu,%s,%zu,%.1f,%.1f,%.1f\n", rss_mib, method, runs, (double)total / runs / 1000,
+            (double)run_ns[runs / 2] / 1000, (double)run_ns[runs * 99 / 100] / 1000);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct
+    {
+        const char *name;
+        bool (*launch)(void);
+    } methods[] = {
+        { "fork_execv", fork_execv },
+        { "do_exec", spawn },
+    };
+    size_t rss_list[16] = { 0, 64, 256, 1024 };
+    size_t nrss = 4;
+    size_t runs = 200;
+    size_t resident = 0;
+    uint64_t *run_ns;
+    char *heap = NULL;
+    char *arg;
+    size_t r, m, i;
+    uint64_t start;
+    int opt;
+
+    while((opt = getopt(argc, argv, "Hr:m:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H':
+                printf("benchmark,rss_mib,method,runs,mean_us,p50_us,p99_us\n");
+                break;
+            case 'r':
+                runs = strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                // comma separated list of resident set sizes in MiB, in increasing order
+                nrss = 0;
+                for(arg = strtok(optarg, ","); arg && nrss < sizeof(rss_list) / sizeof(rss_list[0]);
+                        arg = strtok(NULL, ","))
+                    rss_list[nrss++] = strtoul(arg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-H] [-r runs] [-m rss_mib,...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if(runs == 0)
+        runs = 1;
+
+    run_ns = malloc(runs * sizeof(uint64_t));
+    if(!run_ns)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    for(r = 0; r < nrss; r++)
+    {
+        // grow the heap and touch every page so it is really resident
+        if(rss_list[r] > resident)
+        {
+            free(heap);
+            heap = malloc(rss_list[r] << 20);
+            if(!heap)
+            {
+                perror("malloc");
+                return 1;
+            }
+            memset(heap, 1, rss_list[r] << 20);
+            resident = rss_list[r];
+        }
+
+        for(m = 0; m < sizeof(methods) / sizeof(methods[0]); m++)
+        {
+            for(i = 0; i < runs; i++)
+            {
+                start = now_ns();
+                if(!methods[m].launch())
+                {
+                    fprintf(stderr, "%s failed to run %s\n", methods[m].name, COMMAND);
+                    return 1;
+                }
+                run_ns[i] = now_ns() - start;
+            }
+            report(rss_list[r], methods[m].name, run_ns, runs);
+        }
+    }
+
+    free(heap);
+    free(run_ns);
+    return 0;
+}
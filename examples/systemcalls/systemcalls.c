@@ -1,10 +1,72 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <spawn.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+extern char **environ;
+
+/**
+ * Runs @param command, a NULL terminated argument list starting with the absolute path of
+ * the program, and waits for it to finish.  When @param outputfile is not NULL the command's
+ * standard output is redirected to it, truncating any existing file.
+ * posix_spawn() starts the child without copying the caller's page tables, so the cost does
+ * not grow with the size of the calling process, and a failed exec is reported here instead
+ * of leaving a copy of the caller running.
+ * @return true if the command ran and exited with status 0
+ */
+static bool spawn_and_wait(const char *outputfile, char *command[])
+{
+	posix_spawn_file_actions_t actions;
+	pid_t pid;
+	int status;
+	int err;
+
+	// exec does not search PATH, the command must be given as a full path
+	if (command[0] == NULL || command[0][0] != '/')
+	{
+		return false;
+	}
+
+	if (posix_spawn_file_actions_init(&actions) != 0)
+	{
+		return false;
+	}
+
+	if (outputfile != NULL &&
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+			O_WRONLY|O_TRUNC|O_CREAT, 0644) != 0)
+	{
+		posix_spawn_file_actions_destroy(&actions);
+		return false;
+	}
+
+	err = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (err != 0)
+	{
+		return false;
+	}
+
+	while (waitpid(pid, &status, 0) == -1)
+	{
+		if (errno != EINTR)
+		{
+			return false;
+		}
+	}
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -41,9 +103,9 @@ bool do_system(const char *cmd)
 *   The first is always the full path to the command to execute with execv()
 *   The remaining arguments are a list of arguments to pass to the command in execv()
 * @return true if the command @param ... with arguments @param arguments were executed successfully
-*   using the execv() call, false if an error occurred, either in invocation of the
-*   fork, waitpid, or execv() command, or if a non-zero return value was returned
-*   by the command issued in @param arguments with the specified arguments.
+*   using posix_spawn(), false if an error occurred, either in invocation of the
+*   posix_spawn() or waitpid() call, or if the command issued in @param arguments
+*   did not exit normally with a zero status.
 */
 
 bool do_exec(int count, ...)
@@ -62,62 +124,17 @@ bool do_exec(int count, ...)
     command[count] = command[count];
 
 /*
- * TODO:
- *   Execute a system command by calling fork, execv(),
- *   and wait instead of system (see LSP page 161).
- *   Use the command[0] as the full path to the command to execute
- *   (first argument to execv), and use the remaining arguments
- *   as second argument to the execv() command.
- *
+ * Executes command[0] with posix_spawn(), which combines the fork/execv() pair
+ * (see LSP page 161) without duplicating this process, and waits for it.
+ * Use the command[0] as the full path to the command to execute
+ * and the remaining arguments as its argument list.
 */
 
-	if (command[0][0] != '/')
-	{
-		return false;
-	}
-	
-	char* command_args[count];
-	for (int j = 0; j < count-1; j++)
-	{
-		command_args[j] = command[j+1];
-
-		if (command_args[j][0] != '/' && command_args[j][0] != '-')
-		{
-			return false;
-		}
-	}
+	bool ok = spawn_and_wait(NULL, command);
 
-	int pid = fork();
-	
-	if (pid == 0)
-	{
-		int sys_command = execv(command[0], command);
-		
-		if (sys_command != 0)
-		{
-			//printf("103 - sys_command: %d\n", sys_command);
-			return false;
-		}
-	}
-	else if (pid > 0)
-	{
-		int status;
-		int child_pid = waitpid(pid, &status, 0);
-		
-		if (child_pid == -1)
-		{
-			return false;
-		}
-	}
-	else if (pid < 0)
-	{
-		return false;
-	}
-	
-	
     va_end(args);
 
-    return true;
+    return ok;
 }
 
 /**
@@ -142,61 +159,346 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
 
 
 /*
- * TODO
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a reference,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
- *
+ * Same as do_exec(), with standard out redirected to outputfile by a
+ * posix_spawn file action instead of the dup2() from
+ * https://stackoverflow.com/a/13784315/1446624 in the child.
 */
 
-	if (command[0][0] != '/')
+	bool ok = spawn_and_wait(outputfile, command);
+
+    va_end(args);
+
+    return ok;
+}
+
+/*
+ * One command of a do_exec_batch() call that is still running
+ */
+struct batch_slot
+{
+	size_t index;		/* into the commands and results arrays */
+	pid_t pid;
+	int fd[2];		/* read ends of the stdout and stderr pipes, -1 once at end of file */
+	size_t cap[2];		/* allocated size of the matching result buffer */
+	uint64_t start_ns;
+};
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Launches @param command with stdout and stderr on fresh pipes, whose read ends are left
+ * non-blocking in @param slot.
+ * @return false if the command could not be started
+ */
+static bool batch_start(char *const command[], struct batch_slot *slot)
+{
+	posix_spawn_file_actions_t actions;
+	int out[2] = { -1, -1 };
+	int err[2] = { -1, -1 };
+	bool ok = false;
+
+	if (command == NULL || command[0] == NULL || command[0][0] != '/')
 	{
 		return false;
 	}
-	
-	int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-	if (fd < 0)
+
+	// close on exec keeps the other commands of the batch from holding these pipes open
+	if (pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0)
 	{
-		return false;
+		goto escape;
 	}
 
-	int pid = fork();
-	
-	if (pid == 0)
+	if (posix_spawn_file_actions_init(&actions) != 0)
+	{
+		goto escape;
+	}
+
+	if (posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO) == 0 &&
+		posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO) == 0 &&
+		posix_spawn(&slot->pid, command[0], &actions, NULL, command, environ) == 0)
 	{
-		if (dup2(fd, 1) < 0)
+		ok = true;
+	}
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (ok)
+	{
+		slot->start_ns = monotonic_ns();
+		slot->fd[0] = out[0];
+		slot->fd[1] = err[0];
+		slot->cap[0] = 0;
+		slot->cap[1] = 0;
+		fcntl(out[0], F_SETFL, O_NONBLOCK);
+		fcntl(err[0], F_SETFL, O_NONBLOCK);
+		out[0] = -1;
+		err[0] = -1;
+	}
+
+escape:
+	if (out[0] != -1) close(out[0]);
+	if (out[1] != -1) close(out[1]);
+	if (err[0] != -1) close(err[0]);
+	if (err[1] != -1) close(err[1]);
+	return ok;
+}
+
+/**
+ * Appends everything that can be read from *@param fd without blocking to @param buf,
+ * growing it as needed, and closes *fd once the command has closed its end.
+ * @return false if the buffer could not grow, *fd is closed and the rest of the output lost
+ */
+static bool batch_read(int *fd, char **buf, size_t *len, size_t *cap)
+{
+	ssize_t n;
+
+	for (;;)
+	{
+		if (*cap - *len < 4096)
 		{
-			close(fd);
-			return false;
+			size_t grown_cap = *cap ? *cap * 2 : 4096;
+			// one extra byte for the terminating NUL
+			char *grown = realloc(*buf, grown_cap + 1);
+
+			if (grown == NULL)
+			{
+				break;
+			}
+			*buf = grown;
+			*cap = grown_cap;
 		}
-		
-		close(fd);
-		int sys_command = execv(command[0], command);
-		
-		if (sys_command != 0)
+
+		n = read(*fd, *buf + *len, *cap - *len);
+		if (n > 0)
 		{
-			return false;
+			*len += n;
+			(*buf)[*len] = '\0';
+		}
+		else if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return true;
+		}
+		else
+		{
+			close(*fd);
+			*fd = -1;
+			// a command that wrote nothing leaves no buffer, as struct exec_result documents
+			if (*len == 0)
+			{
+				free(*buf);
+				*buf = NULL;
+				*cap = 0;
+			}
+			return true;
 		}
 	}
-	else if (pid > 0)
+
+	close(*fd);
+	*fd = -1;
+	return false;
+}
+
+/**
+ * Kills the @param running commands in @param slots and reaps them, recording how they
+ * ended in @param results, when the batch cannot go on servicing their pipes.
+ */
+static void batch_abort(struct batch_slot *slots, size_t running, struct exec_result results[])
+{
+	struct exec_result *result;
+	size_t i;
+	int status;
+
+	for (i = 0; i < running; i++)
 	{
-		int status;
-		int child_pid = waitpid(pid, &status, 0);
-		
-		if (child_pid == -1)
+		result = &results[slots[i].index];
+		kill(slots[i].pid, SIGKILL);
+		if (slots[i].fd[0] != -1) close(slots[i].fd[0]);
+		if (slots[i].fd[1] != -1) close(slots[i].fd[1]);
+
+		while (waitpid(slots[i].pid, &status, 0) == -1)
 		{
-			close(fd);
-			return false;
+			if (errno != EINTR)
+			{
+				result->started = false;
+				break;
+			}
+		}
+		if (result->started)
+		{
+			result->status = status;
 		}
+		result->elapsed_ns = monotonic_ns() - slots[i].start_ns;
+	}
+}
+
+/**
+* @param commands - @param count NULL terminated argument lists, each starting with the full
+*   path of the command to run as for do_exec()
+* @param max_parallel - the most commands to have running at any time, 0 is treated as 1
+* @param results - @param count results, filled in the order of @param commands. Release each
+*   with exec_result_free().
+* Runs every command, keeping up to @param max_parallel of them running at once, and captures
+* their stdout and stderr in memory through pipes serviced with poll().
+* @return true if every command was started and exited normally with a zero status
+*/
+bool do_exec_batch(char *const *commands[], size_t count, size_t max_parallel,
+	struct exec_result results[])
+{
+	struct batch_slot *slots = NULL;
+	struct pollfd *fds = NULL;
+	struct exec_result *result;
+	size_t next = 0;
+	size_t running = 0;
+	size_t i;
+	bool waiting;
+	bool ok = true;
+	int status;
+	pid_t reaped;
+
+	memset(results, 0, count * sizeof(*results));
+	if (count == 0)
+	{
+		return true;
+	}
+
+	if (max_parallel == 0)
+	{
+		max_parallel = 1;
 	}
-	else if (pid < 0)
+	if (max_parallel > count)
 	{
-		close(fd);
+		max_parallel = count;
+	}
+
+	slots = calloc(max_parallel, sizeof(*slots));
+	fds = calloc(2 * max_parallel, sizeof(*fds));
+	if (slots == NULL || fds == NULL)
+	{
+		free(slots);
+		free(fds);
 		return false;
 	}
-	
 
-    va_end(args);
+	while (next < count || running > 0)
+	{
+		while (next < count && running < max_parallel)
+		{
+			slots[running].index = next;
+			if (batch_start(commands[next], &slots[running]))
+			{
+				results[next].started = true;
+				running++;
+			}
+			else
+			{
+				ok = false;
+			}
+			next++;
+		}
 
-    return true;
+		if (running == 0)
+		{
+			break;
+		}
+
+		// closed pipes have a negative fd, which poll() skips
+		waiting = false;
+		for (i = 0; i < running; i++)
+		{
+			fds[2 * i].fd = slots[i].fd[0];
+			fds[2 * i].events = POLLIN;
+			fds[2 * i + 1].fd = slots[i].fd[1];
+			fds[2 * i + 1].events = POLLIN;
+			if (slots[i].fd[0] == -1 && slots[i].fd[1] == -1)
+			{
+				waiting = true;
+			}
+		}
+
+		// a command that closed its output but has not exited yet is polled for with waitpid()
+		if (poll(fds, 2 * running, waiting ? 1 : -1) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			// nothing would ever drain the pipes again, so nothing would ever exit
+			batch_abort(slots, running, results);
+			ok = false;
+			break;
+		}
+
+		for (i = 0; i < running; i++)
+		{
+			result = &results[slots[i].index];
+			if (slots[i].fd[0] != -1 && fds[2 * i].revents != 0 &&
+				!batch_read(&slots[i].fd[0], &result->out, &result->out_len, &slots[i].cap[0]))
+			{
+				ok = false;
+			}
+			if (slots[i].fd[1] != -1 && fds[2 * i + 1].revents != 0 &&
+				!batch_read(&slots[i].fd[1], &result->err, &result->err_len, &slots[i].cap[1]))
+			{
+				ok = false;
+			}
+		}
+
+		// reap the commands whose output is complete, moving the last slot into the hole
+		for (i = 0; i < running; )
+		{
+			if (slots[i].fd[0] != -1 || slots[i].fd[1] != -1)
+			{
+				i++;
+				continue;
+			}
+
+			reaped = waitpid(slots[i].pid, &status, WNOHANG);
+			if (reaped == 0 || (reaped == -1 && errno == EINTR))
+			{
+				i++;
+				continue;
+			}
+
+			result = &results[slots[i].index];
+			result->elapsed_ns = monotonic_ns() - slots[i].start_ns;
+			if (reaped == -1)
+			{
+				result->started = false;
+				ok = false;
+			}
+			else
+			{
+				result->status = status;
+				if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				{
+					ok = false;
+				}
+			}
+			slots[i] = slots[--running];
+		}
+	}
+
+	free(slots);
+	free(fds);
+	return ok;
+}
+
+/**
+* Releases the output captured in @param result by do_exec_batch()
+*/
+void exec_result_free(struct exec_result *result)
+{
+	free(result->out);
+	free(result->err);
+	memset(result, 0, sizeof(*result));
 }
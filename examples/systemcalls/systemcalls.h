@@ -1,9 +1,30 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * Outcome of one command run by do_exec_batch()
+ */
+struct exec_result
+{
+	bool started;		/* false if the command could not be launched */
+	int status;		/* waitpid() status, valid when started */
+	uint64_t elapsed_ns;	/* from launch until the command was reaped */
+	char *out;		/* everything the command wrote to stdout, NUL terminated, NULL if nothing */
+	size_t out_len;
+	char *err;		/* everything the command wrote to stderr, same as out */
+	size_t err_len;
+};
+
+bool do_exec_batch(char *const *commands[], size_t count, size_t max_parallel,
+	struct exec_result results[]);
+
+void exec_result_free(struct exec_result *result);
@@ -1,52 +1,243 @@
+#define _GNU_SOURCE
 #include "threading.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
 
 // Optional: use these functions to add debug or error prints to your application
 #define DEBUG_LOG(msg,...)
 //#define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
 #define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
 
-void* threadfunc(void* thread_param)
+// waits shorter than this spin on the clock, a sleep would overshoot them by its wakeup latency
+#define SPIN_WAIT_NS 50000
+// failed polls of a ticket lock before its waiter gives up the CPU to the holder
+#define TICKET_SPINS_BEFORE_YIELD 1024
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Waits @param ns nanoseconds, by spinning for short waits and sleeping until an absolute
+ * deadline for long ones so that signals and early wakeups do not shorten the wait.
+ */
+static void wait_ns(uint64_t ns)
+{
+    uint64_t deadline;
+    struct timespec ts;
+
+    if (ns == 0)
+        return;
+
+    deadline = now_ns() + ns;
+    if (ns < SPIN_WAIT_NS)
+    {
+        while (now_ns() < deadline)
+            cpu_relax();
+        return;
+    }
+
+    ts.tv_sec = deadline / 1000000000ull;
+    ts.tv_nsec = deadline % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+bool thread_lock_init(struct thread_lock *lock, enum thread_lock_kind kind)
+{
+    pthread_mutexattr_t attr;
+    bool ok;
+
+    lock->kind = kind;
+    switch (kind)
+    {
+        case THREAD_LOCK_MUTEX:
+            return pthread_mutex_init(&lock->mutex, NULL) == 0;
+        case THREAD_LOCK_ADAPTIVE:
+            if (pthread_mutexattr_init(&attr) != 0)
+                return false;
+#ifdef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+            pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+            ok = pthread_mutex_init(&lock->mutex, &attr) == 0;
+            pthread_mutexattr_destroy(&attr);
+            return ok;
+        case THREAD_LOCK_SPIN:
+            return pthread_spin_init(&lock->spin, PTHREAD_PROCESS_PRIVATE) == 0;
+        case THREAD_LOCK_TICKET:
+            atomic_init(&lock->ticket.next, 0);
+            atomic_init(&lock->ticket.serving, 0);
+            return true;
+    }
+    return false;
+}
+
+void thread_lock_destroy(struct thread_lock *lock)
+{
+    switch (lock->kind)
+    {
+        case THREAD_LOCK_MUTEX:
+        case THREAD_LOCK_ADAPTIVE:
+            pthread_mutex_destroy(&lock->mutex);
+            break;
+        case THREAD_LOCK_SPIN:
+            pthread_spin_destroy(&lock->spin);
+            break;
+        case THREAD_LOCK_TICKET:
+            break;
+    }
+}
+
+bool thread_lock_acquire(struct thread_lock *lock)
+{
+    unsigned int ticket;
+    unsigned int spins = 0;
+
+    switch (lock->kind)
+    {
+        case THREAD_LOCK_MUTEX:
+        case THREAD_LOCK_ADAPTIVE:
+            return pthread_mutex_lock(&lock->mutex) == 0;
+        case THREAD_LOCK_SPIN:
+            return pthread_spin_lock(&lock->spin) == 0;
+        case THREAD_LOCK_TICKET:
+            ticket = atomic_fetch_add_explicit(&lock->ticket.next, 1, memory_order_relaxed);
+            while (atomic_load_explicit(&lock->ticket.serving, memory_order_acquire) != ticket)
+            {
+                if (++spins % TICKET_SPINS_BEFORE_YIELD == 0)
+                    sched_yield();
+                else
+                    cpu_relax();
+            }
+            return true;
+    }
+    return false;
+}
+
+bool thread_lock_release(struct thread_lock *lock)
 {
-    // TODO: wait, obtain mutex, wait, release mutex as described by thread_data structure
-    // hint: use a cast like the one below to obtain thread arguments from your parameter
-    //struct thread_data* thread_func_args = (struct thread_data *) thread_param;
-    //pthread_detach(pthread_self());
+    unsigned int serving;
+
+    switch (lock->kind)
+    {
+        case THREAD_LOCK_MUTEX:
+        case THREAD_LOCK_ADAPTIVE:
+            return pthread_mutex_unlock(&lock->mutex) == 0;
+        case THREAD_LOCK_SPIN:
+            return pthread_spin_unlock(&lock->spin) == 0;
+        case THREAD_LOCK_TICKET:
+            // only the holder writes serving, so a plain increment is enough
+            serving = atomic_load_explicit(&lock->ticket.serving, memory_order_relaxed);
+            atomic_store_explicit(&lock->ticket.serving, serving + 1, memory_order_release);
+            return true;
+    }
+    return false;
+}
 
+void* threadfunc(void* thread_param)
+{
     struct thread_data* thread_func_args = (struct thread_data *) thread_param;
-    sleep((*thread_func_args).wait_to_obtain_ms * 0.001);
-    pthread_mutex_lock((*thread_func_args).mutex);
-    sleep((*thread_func_args).wait_to_release_ms * 0.001);
-    pthread_mutex_unlock((*thread_func_args).mutex);
+    uint64_t start;
+    size_t i;
+
+    if (thread_func_args->lock == NULL)
+    {
+        wait_ns((uint64_t)thread_func_args->wait_to_obtain_ms * 1000000);
+        if (pthread_mutex_lock(thread_func_args->mutex) != 0)
+        {
+            ERROR_LOG("could not obtain mutex");
+            return thread_func_args;
+        }
+        wait_ns((uint64_t)thread_func_args->wait_to_release_ms * 1000000);
+        if (pthread_mutex_unlock(thread_func_args->mutex) != 0)
+        {
+            ERROR_LOG("could not release mutex");
+            return thread_func_args;
+        }
+
+        thread_func_args->thread_complete_success = true;
+        return thread_func_args;
+    }
+
+    if (thread_func_args->start)
+        pthread_barrier_wait(thread_func_args->start);
+
+    for (i = 0; i < thread_func_args->iterations; i++)
+    {
+        wait_ns(thread_func_args->wait_to_obtain_ns[i]);
+
+        start = now_ns();
+        if (!thread_lock_acquire(thread_func_args->lock))
+        {
+            ERROR_LOG("could not obtain lock");
+            return thread_func_args;
+        }
+        if (thread_func_args->latency_ns)
+            thread_func_args->latency_ns[i] = now_ns() - start;
+
+        wait_ns(thread_func_args->wait_to_release_ns[i]);
+        if (!thread_lock_release(thread_func_args->lock))
+        {
+            ERROR_LOG("could not release lock");
+            return thread_func_args;
+        }
+    }
 
-    (*thread_func_args).thread_complete_success = true;
-    
+    thread_func_args->thread_complete_success = true;
     return thread_func_args;
 }
 
 
-bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms)
+bool start_thread_obtaining_lock(pthread_t *thread, const struct thread_data *params)
 {
-    /**
-     * TODO: allocate memory for thread_data, setup mutex and wait arguments, pass thread_data to created thread
-     * using threadfunc() as entry point.
-     *
-     * return true if successful.
-     *
-     * See implementation details in threading.h file comment block
-    **/
-
     struct thread_data* thread_param = (struct thread_data*)malloc(sizeof(struct thread_data));
-    thread_param->mutex = mutex;
-    thread_param->wait_to_obtain_ms = wait_to_obtain_ms;
-    thread_param->wait_to_release_ms = wait_to_release_ms;
+    int rc;
+
+    if (thread_param == NULL)
+    {
+        ERROR_LOG("could not allocate thread data");
+        return false;
+    }
+
+    *thread_param = *params;
     thread_param->thread_complete_success = false;
 
-    printf("address of struct pointer %p \n\n\n", thread_param);
-    
-    int rc = pthread_create(thread, NULL, &threadfunc, thread_param);
+    DEBUG_LOG("address of struct pointer %p", thread_param);
+
+    rc = pthread_create(thread, NULL, &threadfunc, thread_param);
+    if (rc != 0)
+    {
+        ERROR_LOG("pthread_create failed with %d", rc);
+        free(thread_param);
+        return false;
+    }
 
-    return (rc == 0);
-}
\ No newline at end of file
+    return true;
+}
+
+bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    struct thread_data params = {
+        .mutex = mutex,
+        .wait_to_obtain_ms = wait_to_obtain_ms,
+        .wait_to_release_ms = wait_to_release_ms,
+    };
+
+    return start_thread_obtaining_lock(thread, &params);
+}
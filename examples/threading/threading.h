@@ -1,6 +1,30 @@
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
+/**
+ * The kinds of lock a thread started by start_thread_obtaining_lock can contend on.
+ */
+enum thread_lock_kind {
+    THREAD_LOCK_MUTEX,      /* default pthread mutex, sleeps in the kernel when contended */
+    THREAD_LOCK_ADAPTIVE,   /* pthread mutex that spins a while before sleeping, glibc only */
+    THREAD_LOCK_SPIN,       /* pthread spinlock, never sleeps */
+    THREAD_LOCK_TICKET,     /* FIFO ticket lock, spins then yields */
+};
+
+struct thread_lock {
+    enum thread_lock_kind kind;
+    union {
+        pthread_mutex_t mutex;
+        pthread_spinlock_t spin;
+        struct {
+            atomic_uint next;
+            atomic_uint serving;
+        } ticket;
+    };
+};
+
 /**
  * This structure should be dynamically allocated and passed as
  * an argument to your thread using pthread_create.
@@ -22,6 +46,20 @@ struct thread_data{
      * if an error occurred.
     **/
     bool thread_complete_success;
+
+    /*
+     * Used by start_thread_obtaining_lock, which contends on lock instead of mutex
+     * iterations times.  Iteration i waits wait_to_obtain_ns[i] before obtaining the lock
+     * and holds it for wait_to_release_ns[i].  When latency_ns is set, the time spent
+     * obtaining the lock in iteration i is stored in latency_ns[i].  When start is set,
+     * every thread waits on it before its first iteration.
+     */
+    struct thread_lock *lock;
+    size_t iterations;
+    const uint32_t *wait_to_obtain_ns;
+    const uint32_t *wait_to_release_ns;
+    uint64_t *latency_ns;
+    pthread_barrier_t *start;
 };
 
 
@@ -40,3 +78,20 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Like start_thread_obtaining_mutex, but the thread runs the iterations described by the lock,
+* iterations, wait and latency members of @param params, which is copied into the thread_data
+* the thread returns.
+* @return true if the thread could be started, false if a failure occurred.
+*/
+bool start_thread_obtaining_lock(pthread_t *thread, const struct thread_data *params);
+
+/**
+* Initialises @param lock as a lock of @param kind.
+* @return true on success, false if the underlying pthread object could not be created.
+*/
+bool thread_lock_init(struct thread_lock *lock, enum thread_lock_kind kind);
+void thread_lock_destroy(struct thread_lock *lock);
+bool thread_lock_acquire(struct thread_lock *lock);
+bool thread_lock_release(struct thread_lock *lock);
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Compares finder.sh with the native finder on a generated tree of many small files.
+# Usage: finder-bench.sh [numdirs] [filesperdir] [runs]
+# Run "make" in this directory first.
+
+set -e
+set -u
+cd `dirname $0`
+
+NUMDIRS=${1:-100}
+FILESPERDIR=${2:-200}
+RUNS=${3:-5}
+SEARCHSTR=AELD_IS_FUN
+BENCHDIR=/tmp/aeld-finder-bench
+
+if [ ! -x ./finder ]
+then
+	echo "build the native finder with make first"
+	exit 1
+fi
+
+echo "Writing $((NUMDIRS * FILESPERDIR)) files to ${BENCHDIR}"
+rm -rf "${BENCHDIR}"
+for d in $(seq 1 $NUMDIRS)
+do
+	mkdir -p "${BENCHDIR}/dir$d"
+	for f in $(seq 1 $FILESPERDIR)
+	do
+		printf 'line one\n%s line %d\nline three\n' "${SEARCHSTR}" "$f" > "${BENCHDIR}/dir$d/file$f.txt"
+	done
+done
+
+# prints the mean wall clock milliseconds of RUNS runs of the command
+time_ms()
+{
+	total=0
+	for i in $(seq 1 $RUNS)
+	do
+		start=$(date +%s%N)
+		"$@" > /dev/null
+		end=$(date +%s%N)
+		total=$((total + (end - start) / 1000000))
+	done
+	echo $((total / RUNS))
+}
+
+SHELLOUT=$(./finder.sh "${BENCHDIR}" "${SEARCHSTR}")
+NATIVEOUT=$(./finder "${BENCHDIR}" "${SEARCHSTR}")
+if [ "${SHELLOUT}" != "${NATIVEOUT}" ]
+then
+	echo "outputs differ: '${SHELLOUT}' and '${NATIVEOUT}'"
+	exit 1
+fi
+echo "${NATIVEOUT}"
+
+echo "finder.sh: $(time_ms ./finder.sh "${BENCHDIR}" "${SEARCHSTR}") ms"
+echo "finder:    $(time_ms ./finder "${BENCHDIR}" "${SEARCHSTR}") ms"
+
+rm -rf "${BENCHDIR}"
@@ -54,10 +54,11 @@ fi
 #make clean
 #make
 
+# one writer process for all the files, fed a manifest of path<TAB>content lines
 for i in $( seq 1 $NUMFILES)
 do
-	./writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\t%s\n' "$WRITEDIR/${username}$i.txt" "$WRITESTR"
+done | ./writer -b
 
 
 OUTPUTSTRING=$(./finder.sh "$WRITEDIR" "$WRITESTR")
@@ -0,0 +1,551 @@
+/*
+ * finder.c
+ *
+ * Native version of finder.sh: prints the number of entries in a directory and the number of
+ * lines below it containing a string, in one pass over the tree.
+ *
+ * The counts match finder.sh on ordinary trees:
+ *   files   the top level entries "ls" shows, that is everything not starting with '.'
+ *   lines   the lines "grep -r" prints, searching every regular file below the directory
+ *           without following symbolic links, and skipping files with a NUL byte, which
+ *           GNU grep 3.5 and later only report on stderr as "binary file matches"
+ * The string is matched literally where grep treats it as a basic regular expression.
+ *
+ * Directories are tasks on per thread deques.  A thread searches the files of the directory
+ * it lists itself and pushes the subdirectories on its own deque, working from the bottom of
+ * it while idle threads steal from the top of the others.  Small files are read into a per
+ * thread buffer, large ones mapped, and both searched with a vector substring search.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__SSE2__) && defined(__GNUC__)
+#define FINDER_X86 1
+#include <immintrin.h>
+#endif
+#endif
+
+#define MAX_THREADS 64
+#define SMALL_FILE_SIZE (64 * 1024)
+
+struct task
+{
+	char *path;		/* directory to search */
+};
+
+/*
+ * Growable array used as a deque: the owner pushes and pops at the bottom, thieves take
+ * from the top.
+ */
+struct deque
+{
+	pthread_mutex_t lock;
+	struct task *tasks;
+	size_t top;
+	size_t bottom;
+	size_t cap;
+};
+
+struct finder
+{
+	const char *needle;
+	size_t needle_len;
+	struct deque *deques;
+	int nthreads;
+	atomic_size_t pending;		/* tasks pushed and not yet finished */
+	atomic_size_t lines;
+	atomic_bool failed;
+};
+
+struct worker
+{
+	struct finder *finder;
+	int id;
+	char buf[SMALL_FILE_SIZE];	/* small files are read here instead of mapped */
+};
+
+static bool deque_push(struct deque *deque, struct task task)
+{
+	bool ok = true;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom == deque->cap)
+	{
+		// slide the live tasks down before growing
+		if (deque->top > 0)
+		{
+			memmove(deque->tasks, deque->tasks + deque->top,
+				(deque->bottom - deque->top) * sizeof(struct task));
+			deque->bottom -= deque->top;
+			deque->top = 0;
+		}
+
+		if (deque->bottom == deque->cap)
+		{
+			size_t cap = deque->cap ? deque->cap * 2 : 64;
+			struct task *tasks = realloc(deque->tasks, cap * sizeof(struct task));
+
+			if (tasks == NULL)
+			{
+				ok = false;
+			}
+			else
+			{
+				deque->tasks = tasks;
+				deque->cap = cap;
+			}
+		}
+	}
+
+	if (ok)
+	{
+		deque->tasks[deque->bottom++] = task;
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return ok;
+}
+
+static bool deque_pop(struct deque *deque, struct task *task)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom > deque->top)
+	{
+		*task = deque->tasks[--deque->bottom];
+		found = true;
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return found;
+}
+
+static bool deque_steal(struct deque *deque, struct task *task)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom > deque->top)
+	{
+		*task = deque->tasks[deque->top++];
+		found = true;
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return found;
+}
+
+#ifdef FINDER_X86
+
+/*
+ * Compares the first and last byte of the needle against a vector of candidate positions at
+ * once and only runs memcmp where both match.
+ */
+static const char *find_sse2(const char *hay, size_t len, const char *needle, size_t needle_len)
+{
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+	size_t i;
+
+	for (i = 0; i + needle_len - 1 + 16 <= len; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(hay + i + needle_len - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+		while (mask)
+		{
+			size_t pos = i + __builtin_ctz(mask);
+
+			if (needle_len <= 2 || memcmp(hay + pos + 1, needle + 1, needle_len - 2) == 0)
+			{
+				return hay + pos;
+			}
+			mask &= mask - 1;
+		}
+	}
+
+	return memmem(hay + i, len - i, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *hay, size_t len, const char *needle, size_t needle_len)
+{
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+	size_t i;
+
+	for (i = 0; i + needle_len - 1 + 32 <= len; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + needle_len - 1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+		while (mask)
+		{
+			size_t pos = i + __builtin_ctz(mask);
+
+			if (needle_len <= 2 || memcmp(hay + pos + 1, needle + 1, needle_len - 2) == 0)
+			{
+				return hay + pos;
+			}
+			mask &= mask - 1;
+		}
+	}
+
+	return memmem(hay + i, len - i, needle, needle_len);
+}
+
+static const char *find(const char *hay, size_t len, const char *needle, size_t needle_len)
+{
+	static int have_avx2 = -1;
+
+	// benign race, every thread computes the same answer
+	if (have_avx2 < 0)
+	{
+		have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	}
+
+	return have_avx2 ? find_avx2(hay, len, needle, needle_len) : find_sse2(hay, len, needle, needle_len);
+}
+
+#else
+
+static const char *find(const char *hay, size_t len, const char *needle, size_t needle_len)
+{
+	return memmem(hay, len, needle, needle_len);
+}
+
+#endif
+
+/**
+ * @return the number of lines of @param data containing the needle that grep prints to stdout
+ */
+static size_t count_lines(struct finder *finder, const char *data, size_t size)
+{
+	const char *pos = data;
+	const char *end = data + size;
+	const char *match;
+	const char *newline;
+	size_t lines = 0;
+
+	// an empty pattern matches every line, including an unterminated last one
+	if (finder->needle_len == 0)
+	{
+		for (; pos < end && (newline = memchr(pos, '\n', end - pos)) != NULL; pos = newline + 1)
+		{
+			lines++;
+		}
+		lines += pos < end;
+	}
+	else
+	{
+		while (pos < end && (match = find(pos, end - pos, finder->needle, finder->needle_len)) != NULL)
+		{
+			lines++;
+			newline = memchr(match, '\n', end - match);
+			if (newline == NULL)
+			{
+				break;
+			}
+			pos = newline + 1;
+		}
+	}
+
+	if (lines > 0 && memchr(data, '\0', size) != NULL)
+	{
+		return 0;
+	}
+	return lines;
+}
+
+static void search_file(struct finder *finder, struct worker *worker, int dir_fd, const char *name)
+{
+	struct stat st;
+	void *data;
+	ssize_t len;
+	int fd;
+
+	fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd == -1)
+	{
+		return;
+	}
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		// mapping and unmapping costs more than copying a small file
+		if (st.st_size <= SMALL_FILE_SIZE)
+		{
+			len = read(fd, worker->buf, SMALL_FILE_SIZE);
+			if (len > 0)
+			{
+				atomic_fetch_add(&finder->lines, count_lines(finder, worker->buf, len));
+			}
+		}
+		else
+		{
+			data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED)
+			{
+				madvise(data, st.st_size, MADV_SEQUENTIAL);
+				atomic_fetch_add(&finder->lines, count_lines(finder, data, st.st_size));
+				munmap(data, st.st_size);
+			}
+		}
+	}
+
+	close(fd);
+}
+
+static void push_task(struct finder *finder, struct deque *deque, char *path)
+{
+	struct task task = { .path = path };
+
+	atomic_fetch_add(&finder->pending, 1);
+	if (!deque_push(deque, task))
+	{
+		atomic_store(&finder->failed, true);
+		atomic_fetch_sub(&finder->pending, 1);
+		free(path);
+	}
+}
+
+static void walk_dir(struct finder *finder, struct worker *worker, const char *path)
+{
+	struct deque *deque = &finder->deques[worker->id];
+	struct dirent *entry;
+	struct stat st;
+	DIR *dir;
+	char *child;
+	bool is_dir;
+
+	dir = opendir(path);
+	if (dir == NULL)
+	{
+		return;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+		{
+			continue;
+		}
+
+		// grep -r does not follow symbolic links below the starting directory
+		if (entry->d_type == DT_UNKNOWN)
+		{
+			if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			{
+				continue;
+			}
+			if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+			{
+				continue;
+			}
+			is_dir = S_ISDIR(st.st_mode);
+		}
+		else if (entry->d_type == DT_DIR || entry->d_type == DT_REG)
+		{
+			is_dir = entry->d_type == DT_DIR;
+		}
+		else
+		{
+			continue;
+		}
+
+		if (!is_dir)
+		{
+			search_file(finder, worker, dirfd(dir), entry->d_name);
+			continue;
+		}
+
+		if (asprintf(&child, "%s/%s", path, entry->d_name) == -1)
+		{
+			atomic_store(&finder->failed, true);
+			continue;
+		}
+		push_task(finder, deque, child);
+	}
+
+	closedir(dir);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *worker = arg;
+	struct finder *finder = worker->finder;
+	struct deque *own = &finder->deques[worker->id];
+	struct timespec backoff = { 0, 0 };
+	struct task task;
+	bool found;
+	int i;
+
+	while (atomic_load(&finder->pending) > 0)
+	{
+		found = deque_pop(own, &task);
+		for (i = 1; !found && i < finder->nthreads; i++)
+		{
+			found = deque_steal(&finder->deques[(worker->id + i) % finder->nthreads], &task);
+		}
+
+		if (!found)
+		{
+			// everything left is being worked on, wait for new tasks or the end
+			backoff.tv_nsec = backoff.tv_nsec ? backoff.tv_nsec * 2 : 10000;
+			if (backoff.tv_nsec > 1000000)
+			{
+				backoff.tv_nsec = 1000000;
+			}
+			nanosleep(&backoff, NULL);
+			continue;
+		}
+		backoff.tv_nsec = 0;
+
+		walk_dir(finder, worker, task.path);
+		free(task.path);
+		atomic_fetch_sub(&finder->pending, 1);
+	}
+
+	return NULL;
+}
+
+/**
+ * @return the number of entries in @param dirpath not starting with '.', as ls lists them
+ */
+static long count_visible(const char *dirpath)
+{
+	struct dirent *entry;
+	DIR *dir;
+	long count = 0;
+
+	dir = opendir(dirpath);
+	if (dir == NULL)
+	{
+		return -1;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] != '.')
+		{
+			count++;
+		}
+	}
+
+	closedir(dir);
+	return count;
+}
+
+static int thread_count(void)
+{
+	const char *env = getenv("FINDER_THREADS");
+	long n = env ? strtol(env, NULL, 0) : sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+	{
+		n = 1;
+	}
+	if (n > MAX_THREADS)
+	{
+		n = MAX_THREADS;
+	}
+	return n;
+}
+
+int main(int argc, char* argv[])
+{
+	struct finder finder = { 0 };
+	struct worker *workers;
+	pthread_t threads[MAX_THREADS];
+	struct stat st;
+	char *root;
+	long files;
+	int started;
+	int i;
+
+	if (argc < 3)
+	{
+		printf("the script requires 2 arguments\n");
+		return 1;
+	}
+
+	if (stat(argv[1], &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		printf("first argument must be a valid directory\n");
+		return 1;
+	}
+
+	finder.needle = argv[2];
+	finder.needle_len = strlen(argv[2]);
+	finder.nthreads = thread_count();
+	finder.deques = calloc(finder.nthreads, sizeof(struct deque));
+	workers = calloc(finder.nthreads, sizeof(struct worker));
+	root = strdup(argv[1]);
+	if (finder.deques == NULL || workers == NULL || root == NULL)
+	{
+		perror("finder");
+		return 1;
+	}
+	for (i = 0; i < finder.nthreads; i++)
+	{
+		pthread_mutex_init(&finder.deques[i].lock, NULL);
+	}
+
+	files = count_visible(argv[1]);
+	push_task(&finder, &finder.deques[0], root);
+
+	// this thread is worker 0
+	for (started = 1; started < finder.nthreads; started++)
+	{
+		workers[started].finder = &finder;
+		workers[started].id = started;
+		if (pthread_create(&threads[started], NULL, worker_thread, &workers[started]) != 0)
+		{
+			break;
+		}
+	}
+	workers[0].finder = &finder;
+	workers[0].id = 0;
+	worker_thread(&workers[0]);
+
+	for (i = 1; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	if (files < 0 || atomic_load(&finder.failed))
+	{
+		perror("finder");
+		return 1;
+	}
+
+	printf("The number of files are %ld and the number of matching lines are %zu\n",
+		files, atomic_load(&finder.lines));
+
+	for (i = 0; i < finder.nthreads; i++)
+	{
+		pthread_mutex_destroy(&finder.deques[i].lock);
+		free(finder.deques[i].tasks);
+	}
+	free(finder.deques);
+	free(workers);
+
+	return 0;
+}
@@ -1,35 +1,555 @@
+/*
+ * writer.c
+ *
+ * writer <file> <string>
+ *   Writes string to file, replacing any existing content.
+ *
+ * writer -b [-j threads] [-f none|each|end] [-u] [manifest]
+ *   Bulk mode: writes every file listed in manifest, or standard input when it is absent or
+ *   "-", from this one process.  Each line of the manifest is a path, a tab, and the content
+ *   to write, which runs to the end of the line.  Files are written by a pool of threads,
+ *   the online CPU count unless -j says otherwise.  -f picks when data is flushed to disk:
+ *   never (the default), with fsync after each file, or with one sync() at the end.  -u
+ *   submits the opens, writes and closes through io_uring, in builds with HAVE_LIBURING.
+ *   Prints the number of files written and the rate to standard output.
+ */
+
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
-int main(int argc, char* argv[])
+#define MAX_THREADS 64
+// files a thread claims at a time, also the io_uring batch size
+#define BATCH 32
+
+enum fsync_policy
 {
-	openlog(NULL, 0, LOG_USER);
+	FSYNC_NONE,
+	FSYNC_EACH,
+	FSYNC_END,
+};
 
-	if (argc != 3) 
-	{
-		syslog(LOG_ERR, "script requires 2 args, has: %d args", argc-1);
-		return 1;
-	}
+struct entry
+{
+	const char *path;
+	const char *content;
+	size_t len;
+};
 
+struct bulk
+{
+	struct entry *entries;
+	size_t count;
+	enum fsync_policy fsync;
+	bool uring;
+	atomic_size_t next;	/* first entry no thread has claimed yet */
+	atomic_size_t written;
+	atomic_size_t bytes;
+	atomic_size_t failed;
+};
+
+static int write_single(const char *path, const char *content)
+{
 	FILE *fptr;
-	fptr = fopen(argv[1], "w");
+	fptr = fopen(path, "w");
 
-	if (fptr == NULL) 
+	if (fptr == NULL)
 	{
 		syslog(LOG_ERR, "file could not be created");
 		return 1;
 	}
 
-	syslog(LOG_DEBUG, "Writing %s to %s", argv[2], argv[1]);
-	
-	if (fprintf(fptr, "%s", argv[2]) < 0 )
+	syslog(LOG_DEBUG, "Writing %s to %s", content, path);
+
+	if (fprintf(fptr, "%s", content) < 0 )
 	{
 		syslog(LOG_ERR, "file could not be written to");
 		fclose(fptr);
 		return 1;
 	}
-	
+
 	fclose(fptr);
 
 	return 0;
 }
+
+static bool write_file(const struct entry *entry, enum fsync_policy policy)
+{
+	const char *pos = entry->content;
+	size_t left = entry->len;
+	ssize_t n;
+	bool ok = true;
+	int fd;
+
+	fd = open(entry->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		syslog(LOG_ERR, "%s could not be created: %s", entry->path, strerror(errno));
+		return false;
+	}
+
+	while (left > 0)
+	{
+		n = write(fd, pos, left);
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			syslog(LOG_ERR, "%s could not be written to: %s", entry->path, strerror(errno));
+			ok = false;
+			break;
+		}
+		pos += n;
+		left -= n;
+	}
+
+	if (ok && policy == FSYNC_EACH && fsync(fd) != 0)
+	{
+		syslog(LOG_ERR, "%s could not be synced: %s", entry->path, strerror(errno));
+		ok = false;
+	}
+
+	if (close(fd) != 0)
+	{
+		ok = false;
+	}
+
+	return ok;
+}
+
+#ifdef HAVE_LIBURING
+
+// which request of a file a completion belongs to, kept in the top byte of its user data
+#define URING_WRITE 0ull
+#define URING_FSYNC 1ull
+#define URING_CLOSE 2ull
+#define URING_DATA(op, index) (((op) << 56) | (index))
+#define URING_OP(data) ((data) >> 56)
+#define URING_INDEX(data) ((data) & ((1ull << 56) - 1))
+
+/*
+ * Writes a batch through io_uring: all the opens are submitted at once, then each opened
+ * file gets a linked write, optional fsync and close.
+ * @return the number of files written, whose sizes are added to @param bytes
+ */
+static size_t write_batch_uring(struct io_uring *ring, const struct entry *entries, size_t count,
+	enum fsync_policy policy, size_t *bytes)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int fds[BATCH];
+	bool ok[BATCH];
+	size_t i, ops = 0, written = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_openat(sqe, AT_FDCWD, entries[i].path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		io_uring_sqe_set_data64(sqe, i);
+	}
+	io_uring_submit_and_wait(ring, count);
+
+	for (i = 0; i < count; i++)
+	{
+		io_uring_wait_cqe(ring, &cqe);
+		fds[cqe->user_data] = cqe->res;
+		ok[cqe->user_data] = cqe->res >= 0;
+		if (cqe->res < 0)
+		{
+			syslog(LOG_ERR, "%s could not be created: %s", entries[cqe->user_data].path, strerror(-cqe->res));
+		}
+		io_uring_cqe_seen(ring, cqe);
+	}
+
+	// write -> fsync -> close per file, a failed or short request cancels the rest of its chain
+	for (i = 0; i < count; i++)
+	{
+		if (!ok[i])
+		{
+			continue;
+		}
+
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_write(sqe, fds[i], entries[i].content, entries[i].len, 0);
+		io_uring_sqe_set_data64(sqe, URING_DATA(URING_WRITE, i));
+		sqe->flags |= IOSQE_IO_LINK;
+		ops++;
+
+		if (policy == FSYNC_EACH)
+		{
+			sqe = io_uring_get_sqe(ring);
+			io_uring_prep_fsync(sqe, fds[i], 0);
+			io_uring_sqe_set_data64(sqe, URING_DATA(URING_FSYNC, i));
+			sqe->flags |= IOSQE_IO_LINK;
+			ops++;
+		}
+
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_close(sqe, fds[i]);
+		io_uring_sqe_set_data64(sqe, URING_DATA(URING_CLOSE, i));
+		ops++;
+	}
+	io_uring_submit_and_wait(ring, ops);
+
+	for (; ops > 0; ops--)
+	{
+		io_uring_wait_cqe(ring, &cqe);
+		i = URING_INDEX(cqe->user_data);
+		switch (URING_OP(cqe->user_data))
+		{
+			case URING_WRITE:
+				if (cqe->res < 0 || (size_t)cqe->res != entries[i].len)
+				{
+					syslog(LOG_ERR, "%s could not be written to: %s", entries[i].path,
+						cqe->res < 0 ? strerror(-cqe->res) : "short write");
+					ok[i] = false;
+				}
+				break;
+			case URING_FSYNC:
+				if (cqe->res < 0 && ok[i])
+				{
+					syslog(LOG_ERR, "%s could not be synced: %s", entries[i].path, strerror(-cqe->res));
+					ok[i] = false;
+				}
+				break;
+			case URING_CLOSE:
+				// cancelled along with a failed write or fsync, the descriptor is still open
+				if (cqe->res == -ECANCELED)
+				{
+					close(fds[i]);
+				}
+				break;
+		}
+		io_uring_cqe_seen(ring, cqe);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (ok[i])
+		{
+			written++;
+			*bytes += entries[i].len;
+		}
+	}
+	return written;
+}
+
+#endif
+
+static void *bulk_thread(void *arg)
+{
+	struct bulk *bulk = arg;
+	size_t first, end, i, written, bytes;
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+	bool uring = bulk->uring;
+
+	if (uring && io_uring_queue_init(BATCH * 3, &ring, 0) != 0)
+	{
+		syslog(LOG_ERR, "io_uring could not be set up, writing with system calls");
+		uring = false;
+	}
+#endif
+
+	while ((first = atomic_fetch_add(&bulk->next, BATCH)) < bulk->count)
+	{
+		end = first + BATCH < bulk->count ? first + BATCH : bulk->count;
+		written = 0;
+		bytes = 0;
+
+#ifdef HAVE_LIBURING
+		if (uring)
+		{
+			written = write_batch_uring(&ring, bulk->entries + first, end - first, bulk->fsync, &bytes);
+		}
+		else
+#endif
+		{
+			for (i = first; i < end; i++)
+			{
+				if (write_file(&bulk->entries[i], bulk->fsync))
+				{
+					written++;
+					bytes += bulk->entries[i].len;
+				}
+			}
+		}
+
+		atomic_fetch_add(&bulk->written, written);
+		atomic_fetch_add(&bulk->bytes, bytes);
+		atomic_fetch_add(&bulk->failed, end - first - written);
+	}
+
+#ifdef HAVE_LIBURING
+	if (uring)
+	{
+		io_uring_queue_exit(&ring);
+	}
+#endif
+
+	return NULL;
+}
+
+/**
+ * Reads all of @param fd into a NUL terminated buffer, @return NULL on failure
+ */
+static char *read_all(int fd, size_t *len)
+{
+	size_t cap = 65536;
+	char *buf = malloc(cap + 1);
+	char *grown;
+	ssize_t n;
+
+	*len = 0;
+	while (buf != NULL)
+	{
+		if (*len == cap)
+		{
+			cap *= 2;
+			grown = realloc(buf, cap + 1);
+			if (grown == NULL)
+			{
+				break;
+			}
+			buf = grown;
+		}
+
+		n = read(fd, buf + *len, cap - *len);
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0)
+		{
+			break;
+		}
+		if (n == 0)
+		{
+			buf[*len] = '\0';
+			return buf;
+		}
+		*len += n;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Splits the manifest in @param buf, in place, into entries
+ * @return the number of entries, or -1 on failure
+ */
+static long parse_manifest(char *buf, size_t len, struct entry **entries)
+{
+	char *line = buf;
+	char *end = buf + len;
+	char *newline;
+	char *tab;
+	size_t count = 0;
+	size_t cap = 0;
+	struct entry *grown;
+	long lineno = 0;
+
+	*entries = NULL;
+	for (; line < end; line = newline + 1)
+	{
+		newline = memchr(line, '\n', end - line);
+		if (newline == NULL)
+		{
+			newline = end;
+		}
+		*newline = '\0';
+		lineno++;
+
+		if (line == newline)
+		{
+			continue;
+		}
+
+		tab = memchr(line, '\t', newline - line);
+		if (tab == NULL || tab == line)
+		{
+			syslog(LOG_ERR, "manifest line %ld is not a path, a tab and content", lineno);
+			free(*entries);
+			return -1;
+		}
+		*tab = '\0';
+
+		if (count == cap)
+		{
+			cap = cap ? cap * 2 : 1024;
+			grown = realloc(*entries, cap * sizeof(struct entry));
+			if (grown == NULL)
+			{
+				free(*entries);
+				return -1;
+			}
+			*entries = grown;
+		}
+
+		(*entries)[count].path = line;
+		(*entries)[count].content = tab + 1;
+		(*entries)[count].len = newline - (tab + 1);
+		count++;
+	}
+
+	return count;
+}
+
+static int write_bulk(int argc, char* argv[])
+{
+	struct bulk bulk = { .fsync = FSYNC_NONE };
+	pthread_t threads[MAX_THREADS];
+	struct timespec start, stop;
+	const char *manifest = "-";
+	char *buf;
+	size_t len;
+	double seconds;
+	long count;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int started, i, opt, fd;
+
+	while ((opt = getopt(argc, argv, "bj:f:u")) != -1)
+	{
+		switch (opt)
+		{
+			case 'b':
+				break;
+			case 'j':
+				nthreads = strtol(optarg, NULL, 0);
+				break;
+			case 'f':
+				if (strcmp(optarg, "none") == 0)
+				{
+					bulk.fsync = FSYNC_NONE;
+				}
+				else if (strcmp(optarg, "each") == 0)
+				{
+					bulk.fsync = FSYNC_EACH;
+				}
+				else if (strcmp(optarg, "end") == 0)
+				{
+					bulk.fsync = FSYNC_END;
+				}
+				else
+				{
+					syslog(LOG_ERR, "unknown fsync policy %s", optarg);
+					return 1;
+				}
+				break;
+			case 'u':
+#ifdef HAVE_LIBURING
+				bulk.uring = true;
+#else
+				syslog(LOG_ERR, "built without io_uring support, writing with system calls");
+#endif
+				break;
+			default:
+				syslog(LOG_ERR, "usage: writer -b [-j threads] [-f none|each|end] [-u] [manifest]");
+				return 1;
+		}
+	}
+
+	if (optind < argc)
+	{
+		manifest = argv[optind];
+	}
+	if (nthreads < 1)
+	{
+		nthreads = 1;
+	}
+	if (nthreads > MAX_THREADS)
+	{
+		nthreads = MAX_THREADS;
+	}
+
+	fd = strcmp(manifest, "-") == 0 ? STDIN_FILENO : open(manifest, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		syslog(LOG_ERR, "manifest %s could not be opened", manifest);
+		return 1;
+	}
+	buf = read_all(fd, &len);
+	if (fd != STDIN_FILENO)
+	{
+		close(fd);
+	}
+	if (buf == NULL)
+	{
+		syslog(LOG_ERR, "manifest %s could not be read", manifest);
+		return 1;
+	}
+
+	count = parse_manifest(buf, len, &bulk.entries);
+	if (count < 0)
+	{
+		free(buf);
+		return 1;
+	}
+	bulk.count = count;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// this thread is one of the writers
+	for (started = 1; started < nthreads; started++)
+	{
+		if (pthread_create(&threads[started], NULL, bulk_thread, &bulk) != 0)
+		{
+			break;
+		}
+	}
+	bulk_thread(&bulk);
+	for (i = 1; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	if (bulk.fsync == FSYNC_END)
+	{
+		sync();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("wrote %zu files (%zu bytes) in %.3f s, %.0f files/s\n", atomic_load(&bulk.written),
+		atomic_load(&bulk.bytes), seconds, seconds > 0 ? atomic_load(&bulk.written) / seconds : 0.0);
+	syslog(LOG_DEBUG, "wrote %zu files, %zu failed", atomic_load(&bulk.written), atomic_load(&bulk.failed));
+
+	free(bulk.entries);
+	free(buf);
+
+	return atomic_load(&bulk.failed) > 0 ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+	openlog(NULL, 0, LOG_USER);
+
+	if (argc >= 2 && strcmp(argv[1], "-b") == 0)
+	{
+		return write_bulk(argc, argv);
+	}
+
+	if (argc != 3)
+	{
+		syslog(LOG_ERR, "script requires 2 args, has: %d args", argc-1);
+		return 1;
+	}
+
+	return write_single(argv[1], argv[2]);
+}
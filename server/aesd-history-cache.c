@@ -0,0 +1,117 @@
+/**
+ * @file aesd-history-cache.c
+ * @brief Reference counted in-memory copy of the aesdsocket history
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "aesd-history-cache.h"
+
+static void aesd_history_buffer_put(struct aesd_history_buffer *buffer)
+{
+    if(buffer && atomic_fetch_sub_explicit(&buffer->refs, 1, memory_order_acq_rel) == 1)
+        free(buffer);
+}
+
+/**
+ * Initializes @param cache to hold up to @param cap bytes of history, 0 disabling it.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int aesd_history_cache_init(struct aesd_history_cache *cache, size_t cap)
+{
+    memset(cache, 0, sizeof(struct aesd_history_cache));
+    cache->cap = cap;
+    cache->overflowed = (cap == 0);
+
+    errno = pthread_mutex_init(&cache->lock, NULL);
+    return (errno == 0) ? 0 : -1;
+}
+
+/**
+ * Drops the cache's reference to its buffer, views still held keep it alive.
+ */
+void aesd_history_cache_destroy(struct aesd_history_cache *cache)
+{
+    aesd_history_buffer_put(cache->buffer);
+    pthread_mutex_destroy(&cache->lock);
+    memset(cache, 0, sizeof(struct aesd_history_cache));
+}
+
+/**
+ * Appends @param data to the cached history.  Must mirror every byte appended to the
+ * backing store, in the same order, for the cache to stay a faithful copy.
+ */
+void aesd_history_cache_append(struct aesd_history_cache *cache, const char *data, size_t size)
+{
+    struct aesd_history_buffer *grown;
+    size_t capacity;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if(cache->overflowed)
+        goto escape;
+
+    if(size > cache->cap - cache->size)
+        goto overflow;
+
+    if(!cache->buffer || cache->buffer->capacity - cache->size < size)
+    {
+        capacity = cache->buffer ? cache->buffer->capacity * 2 : 4096;
+        if(capacity < cache->size + size)
+            capacity = cache->size + size;
+        if(capacity > cache->cap)
+            capacity = cache->cap;
+
+        if((grown = malloc(sizeof(struct aesd_history_buffer) + capacity)) == NULL)
+            goto overflow;
+        atomic_init(&grown->refs, 1);
+        grown->capacity = capacity;
+        if(cache->buffer)
+            memcpy(grown->data, cache->buffer->data, cache->size);
+
+        aesd_history_buffer_put(cache->buffer);
+        cache->buffer = grown;
+    }
+
+    // views only cover bytes before cache->size, nobody reads where this lands yet
+    memcpy(cache->buffer->data + cache->size, data, size);
+    cache->size += size;
+    goto escape;
+
+overflow:
+    cache->overflowed = true;
+    aesd_history_buffer_put(cache->buffer);
+    cache->buffer = NULL;
+    cache->size = 0;
+
+escape:
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Takes a read-only view of the whole history, released with aesd_history_cache_put().
+ * @return false if the cache has overflowed or is disabled, and the backing store must be read
+ */
+bool aesd_history_cache_get(struct aesd_history_cache *cache, struct aesd_history_view *view)
+{
+    bool cached;
+
+    pthread_mutex_lock(&cache->lock);
+
+    cached = !cache->overflowed;
+    view->buffer = cached ? cache->buffer : NULL;
+    view->data = view->buffer ? view->buffer->data : NULL;
+    view->size = view->buffer ? cache->size : 0;
+    if(view->buffer)
+        atomic_fetch_add_explicit(&view->buffer->refs, 1, memory_order_relaxed);
+
+    pthread_mutex_unlock(&cache->lock);
+    return cached;
+}
+
+void aesd_history_cache_put(struct aesd_history_view *view)
+{
+    aesd_history_buffer_put(view->buffer);
+    memset(view, 0, sizeof(struct aesd_history_view));
+}
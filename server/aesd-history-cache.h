@@ -0,0 +1,62 @@
+/*
+ * aesd-history-cache.h
+ *
+ *  @brief In-memory copy of an append-only history, shared read-only between connections.
+ *
+ *  The history lives in one contiguous, reference counted buffer.  A reader takes a view,
+ *  a reference plus the length of the history at that moment, and can send it without any
+ *  lock held.  Appends only write past every existing view, so they never copy unless the
+ *  buffer has to grow, and a grown buffer replaces the old one while readers of the old one
+ *  finish with it.  The history only grows, so its length doubles as its version.
+ *
+ *  Once the history would exceed the memory cap the cache gives up for good and every
+ *  later aesd_history_cache_get() fails, sending callers back to the backing store.
+ */
+
+#ifndef AESD_HISTORY_CACHE_H
+#define AESD_HISTORY_CACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define AESD_HISTORY_CACHE_DEFAULT_CAP (64 * 1024 * 1024)
+
+struct aesd_history_buffer
+{
+    atomic_uint refs;
+    size_t capacity;
+    char data[];
+};
+
+struct aesd_history_cache
+{
+    pthread_mutex_t lock;
+    /**
+     * Current buffer, NULL while the history is empty or once the cache has overflowed
+     */
+    struct aesd_history_buffer *buffer;
+    size_t size;
+    size_t cap;
+    bool overflowed;
+};
+
+struct aesd_history_view
+{
+    struct aesd_history_buffer *buffer;
+    const char *data;
+    size_t size;
+};
+
+extern int aesd_history_cache_init(struct aesd_history_cache *cache, size_t cap);
+
+extern void aesd_history_cache_destroy(struct aesd_history_cache *cache);
+
+extern void aesd_history_cache_append(struct aesd_history_cache *cache, const char *data, size_t size);
+
+extern bool aesd_history_cache_get(struct aesd_history_cache *cache, struct aesd_history_view *view);
+
+extern void aesd_history_cache_put(struct aesd_history_view *view);
+
+#endif /* AESD_HISTORY_CACHE_H */
@@ -0,0 +1,444 @@
+/**
+ * @file aesd-replica.c
+ * @brief Streams the entries of an aesd_ring from a leader to follower rings
+ *
+ * One thread per replica: a leader's accepts followers and starts a streaming thread for
+ * each, a follower's connects to the leader, applies what it receives and reconnects when
+ * the connection drops.  Every blocking call is bounded so the threads notice
+ * aesd_replica_stop() within AESD_REPLICA_POLL_MS.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <syslog.h>
+#include <netdb.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "aesd-replica.h"
+
+#define AESD_REPLICA_POLL_MS 500
+#define AESD_REPLICA_RETRY_MS 1000
+#define AESD_REPLICA_BACKLOG 10
+#define AESD_REPLICA_REQUEST_SIZE 8
+#define AESD_REPLICA_HEADER_SIZE 12
+
+struct aesd_replica_link
+{
+    struct aesd_replica *replica;
+    int fd;
+    pthread_t thread;
+    atomic_bool done;
+    SLIST_ENTRY(aesd_replica_link) entries;
+};
+
+/**
+ * Opens a stream socket for @param endpoint, listening on it when @param listening is set
+ * and connected to it otherwise.
+ * @return the socket, or -1 on failure
+ */
+static int aesd_replica_socket(const char *endpoint, bool listening)
+{
+    struct sockaddr_un addr;
+    struct addrinfo hints, *info, *p;
+    char host[256] = "";
+    const char *port = endpoint;
+    const char *colon;
+    int fd = -1;
+    int yes = 1;
+
+    if(strncmp(endpoint, "unix:", strlen("unix:")) == 0)
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(strlen(endpoint + strlen("unix:")) >= sizeof(addr.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, endpoint + strlen("unix:"));
+
+        if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+            return -1;
+
+        if(listening)
+        {
+            // left behind by a leader that did not shut down cleanly
+            unlink(addr.sun_path);
+            if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(fd, AESD_REPLICA_BACKLOG) == 0)
+                return fd;
+        }
+        else if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+
+        close(fd);
+        return -1;
+    }
+
+    if((colon = strrchr(endpoint, ':')) != NULL)
+    {
+        if((size_t)(colon - endpoint) >= sizeof(host))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(host, endpoint, colon - endpoint);
+        host[colon - endpoint] = '\0';
+        port = colon + 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+
+    if(getaddrinfo(host[0] ? host : NULL, port, &hints, &info) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(p = info; p != NULL; p = p->ai_next)
+    {
+        if((fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) == -1)
+            continue;
+
+        if(listening)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if(bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, AESD_REPLICA_BACKLOG) == 0)
+                break;
+        }
+        else if(connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+        {
+            // records are small and written header first, do not hold them back
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            break;
+        }
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(info);
+    return fd;
+}
+
+static int aesd_replica_send(int fd, const void *buf, size_t len, int flags)
+{
+    const char *pos = buf;
+    ssize_t sent;
+
+    while(len > 0)
+    {
+        if((sent = send(fd, pos, len, flags | MSG_NOSIGNAL)) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += sent;
+        len -= sent;
+    }
+
+    return 0;
+}
+
+/**
+ * Receives exactly @param len bytes, giving up when the peer closes or the replica stops.
+ */
+static int aesd_replica_recv(struct aesd_replica *replica, int fd, void *buf, size_t len)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    char *pos = buf;
+    ssize_t received;
+
+    while(len > 0)
+    {
+        if(atomic_load(&replica->stop))
+            return -1;
+        if(poll(&pfd, 1, AESD_REPLICA_POLL_MS) <= 0)
+            continue;
+
+        if((received = recv(fd, pos, len, 0)) == -1)
+        {
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        if(received == 0)
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        pos += received;
+        len -= received;
+    }
+
+    return 0;
+}
+
+// leader side, streams the ring to one follower from the sequence number it asks for
+static void *aesd_replica_stream(void *args)
+{
+    struct aesd_replica_link *link = args;
+    struct aesd_replica *replica = link->replica;
+    unsigned char header[AESD_REPLICA_HEADER_SIZE];
+    uint64_t seq, entry_seq, be_seq;
+    uint32_t be_size;
+    char *buf = NULL;
+    size_t capacity = 0;
+    ssize_t size;
+
+    if(aesd_replica_recv(replica, link->fd, &be_seq, sizeof(be_seq)) == -1)
+        goto escape;
+    seq = be64toh(be_seq);
+    if(seq == 0)
+        seq = 1;
+    syslog(LOG_INFO, "Follower connected, streaming from entry %llu", (unsigned long long)seq);
+
+    while(!atomic_load(&replica->stop))
+    {
+        if((size = aesd_ring_read_entry(replica->ring, seq, &buf, &capacity, &entry_seq)) == -1)
+        {
+            if(errno != ENOENT)
+                break;
+            aesd_ring_wait(replica->ring, seq, AESD_REPLICA_POLL_MS);
+            continue;
+        }
+
+        be_seq = htobe64(entry_seq);
+        be_size = htobe32((uint32_t)size);
+        memcpy(header, &be_seq, sizeof(be_seq));
+        memcpy(header + sizeof(be_seq), &be_size, sizeof(be_size));
+
+        if(aesd_replica_send(link->fd, header, sizeof(header), MSG_MORE) == -1
+                || aesd_replica_send(link->fd, buf, size, 0) == -1)
+        {
+            syslog(LOG_INFO, "Follower disconnected at entry %llu", (unsigned long long)entry_seq);
+            break;
+        }
+        seq = entry_seq + 1;
+    }
+
+escape:
+    free(buf);
+    atomic_store(&link->done, true);
+    return NULL;
+}
+
+/**
+ * Joins and frees the streaming threads that have finished, or all of them when @param all
+ * is set.  Only called from the accepting thread, or after it has been joined.
+ */
+static void aesd_replica_reap(struct aesd_replica *replica, bool all)
+{
+    struct aesd_replica_link *link = SLIST_FIRST(&replica->links);
+    struct aesd_replica_link *next;
+
+    while(link)
+    {
+        next = SLIST_NEXT(link, entries);
+        if(all || atomic_load(&link->done))
+        {
+            // unblocks a send to a follower that stopped reading
+            shutdown(link->fd, SHUT_RDWR);
+            pthread_join(link->thread, NULL);
+            close(link->fd);
+            SLIST_REMOVE(&replica->links, link, aesd_replica_link, entries);
+            free(link);
+        }
+        link = next;
+    }
+}
+
+static void *aesd_replica_accept(void *args)
+{
+    struct aesd_replica *replica = args;
+    struct pollfd pfd = { .fd = replica->listenfd, .events = POLLIN };
+    struct aesd_replica_link *link;
+    int fd;
+
+    while(!atomic_load(&replica->stop))
+    {
+        aesd_replica_reap(replica, false);
+        if(poll(&pfd, 1, AESD_REPLICA_POLL_MS) <= 0)
+            continue;
+
+        if((fd = accept4(replica->listenfd, NULL, NULL, SOCK_CLOEXEC)) == -1)
+            continue;
+
+        if((link = calloc(1, sizeof(struct aesd_replica_link))) == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        link->replica = replica;
+        link->fd = fd;
+        atomic_init(&link->done, false);
+
+        if(pthread_create(&link->thread, NULL, aesd_replica_stream, link) != 0)
+        {
+            syslog(LOG_ERR, "Could not start a replication thread");
+            close(fd);
+            free(link);
+            continue;
+        }
+        SLIST_INSERT_HEAD(&replica->links, link, entries);
+    }
+
+    return NULL;
+}
+
+// follower side, applies the leader's entries to the local ring and reconnects when the link drops
+static void *aesd_replica_pull(void *args)
+{
+    struct aesd_replica *replica = args;
+    unsigned char header[AESD_REPLICA_HEADER_SIZE];
+    uint64_t seq, next, be_seq;
+    uint32_t be_size;
+    char *buf = NULL;
+    char *grown;
+    size_t capacity = 0;
+    size_t size;
+    int fd;
+
+    while(!atomic_load(&replica->stop))
+    {
+        if((fd = aesd_replica_socket(replica->endpoint, false)) == -1)
+        {
+            poll(NULL, 0, AESD_REPLICA_RETRY_MS);
+            continue;
+        }
+
+        next = aesd_ring_next_seq(replica->ring);
+        be_seq = htobe64(next);
+        if(aesd_replica_send(fd, &be_seq, sizeof(be_seq), 0) == 0)
+        {
+            syslog(LOG_INFO, "Following %s from entry %llu", replica->endpoint, (unsigned long long)next);
+
+            while(aesd_replica_recv(replica, fd, header, sizeof(header)) == 0)
+            {
+                memcpy(&be_seq, header, sizeof(be_seq));
+                memcpy(&be_size, header + sizeof(be_seq), sizeof(be_size));
+                seq = be64toh(be_seq);
+                size = be32toh(be_size);
+
+                // a broken leader must not make us allocate up to 4 GiB per record
+                if(size > AESD_REPLICA_MAX_ENTRY_SIZE)
+                {
+                    syslog(LOG_ERR, "Entry %llu from %s is %zu bytes, over the %d byte limit",
+                            (unsigned long long)seq, replica->endpoint, size, AESD_REPLICA_MAX_ENTRY_SIZE);
+                    break;
+                }
+                if(size > capacity)
+                {
+                    if((grown = realloc(buf, size)) == NULL)
+                        break;
+                    buf = grown;
+                    capacity = size;
+                }
+                if(aesd_replica_recv(replica, fd, buf, size) == -1)
+                    break;
+
+                next = aesd_ring_next_seq(replica->ring);
+                if(seq > next)
+                    syslog(LOG_WARNING, "Entries %llu to %llu were evicted by the leader before they were replicated",
+                            (unsigned long long)next, (unsigned long long)(seq - 1));
+
+                // a duplicate can only come from a leader that restarted its numbering, skip it
+                if(aesd_ring_append_seq(replica->ring, buf, size, seq) == -1 && errno != EEXIST)
+                    break;
+            }
+        }
+
+        close(fd);
+        if(!atomic_load(&replica->stop))
+        {
+            syslog(LOG_INFO, "Lost leader %s, reconnecting", replica->endpoint);
+            poll(NULL, 0, AESD_REPLICA_RETRY_MS);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static int aesd_replica_start(struct aesd_replica *replica, struct aesd_ring *ring, const char *endpoint,
+            void *(*thread)(void *))
+{
+    if((replica->endpoint = strdup(endpoint)) == NULL)
+    {
+        if(replica->listenfd != -1)
+            close(replica->listenfd);
+        return -1;
+    }
+    replica->ring = ring;
+    atomic_init(&replica->stop, false);
+    SLIST_INIT(&replica->links);
+
+    if((errno = pthread_create(&replica->thread, NULL, thread, replica)) != 0)
+    {
+        if(replica->listenfd != -1)
+            close(replica->listenfd);
+        free(replica->endpoint);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Listens for followers on @param endpoint and streams the entries of @param ring to each.
+ * @return 0 on success, -1 with errno set if the endpoint could not be opened
+ */
+int aesd_replica_lead(struct aesd_replica *replica, struct aesd_ring *ring, const char *endpoint)
+{
+    memset(replica, 0, sizeof(struct aesd_replica));
+    if((replica->listenfd = aesd_replica_socket(endpoint, true)) == -1)
+        return -1;
+
+    return aesd_replica_start(replica, ring, endpoint, aesd_replica_accept);
+}
+
+/**
+ * Copies the entries of the leader at @param endpoint into @param ring, which should only be
+ * appended to by the replica from then on.  The leader does not need to be up yet.
+ * @return 0 on success, -1 with errno set if the replication thread could not be started
+ */
+int aesd_replica_follow(struct aesd_replica *replica, struct aesd_ring *ring, const char *endpoint)
+{
+    memset(replica, 0, sizeof(struct aesd_replica));
+    replica->listenfd = -1;
+
+    return aesd_replica_start(replica, ring, endpoint, aesd_replica_pull);
+}
+
+/**
+ * Stops @param replica, disconnecting its followers or its leader, and frees its resources.
+ */
+void aesd_replica_stop(struct aesd_replica *replica)
+{
+    atomic_store(&replica->stop, true);
+    pthread_join(replica->thread, NULL);
+    aesd_replica_reap(replica, true);
+
+    if(replica->listenfd != -1)
+    {
+        close(replica->listenfd);
+        if(strncmp(replica->endpoint, "unix:", strlen("unix:")) == 0)
+            unlink(replica->endpoint + strlen("unix:"));
+    }
+
+    free(replica->endpoint);
+    memset(replica, 0, sizeof(struct aesd_replica));
+}
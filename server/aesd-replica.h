@@ -0,0 +1,55 @@
+/*
+ * aesd-replica.h
+ *
+ *  @brief Leader/follower replication of an aesd_ring over TCP or Unix stream sockets.
+ *
+ *  A follower connects to its leader and sends the sequence number of the first entry it is
+ *  missing, as an 8 byte big endian integer.  The leader then streams every stored entry
+ *  from that number on, followed by each new entry as it is appended, as records of
+ *
+ *      8 byte big endian sequence number, 4 byte big endian size, size bytes of data
+ *
+ *  The follower appends each record to its own ring under the leader's sequence number, so
+ *  after a reconnect it resumes from aesd_ring_next_seq() of its ring.  Entries the leader
+ *  has already evicted are skipped and logged as a gap.  A record larger than
+ *  AESD_REPLICA_MAX_ENTRY_SIZE makes the follower drop the connection and reconnect.
+ *
+ *  Endpoints are "unix:/path/to/socket", "host:port" or just "port" for the local host.
+ */
+
+#ifndef AESD_REPLICA_H
+#define AESD_REPLICA_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "aesd-ring.h"
+
+#define AESD_REPLICA_MAX_ENTRY_SIZE (16 * 1024 * 1024)
+
+struct aesd_replica_link;
+
+struct aesd_replica
+{
+    struct aesd_ring *ring;
+    char *endpoint;
+    /**
+     * Listening socket of a leader, -1 for a follower
+     */
+    int listenfd;
+    pthread_t thread;
+    atomic_bool stop;
+    /**
+     * Threads streaming to each connected follower of a leader
+     */
+    SLIST_HEAD(aesd_replica_links, aesd_replica_link) links;
+};
+
+extern int aesd_replica_lead(struct aesd_replica *replica, struct aesd_ring *ring, const char *endpoint);
+
+extern int aesd_replica_follow(struct aesd_replica *replica, struct aesd_ring *ring, const char *endpoint);
+
+extern void aesd_replica_stop(struct aesd_replica *replica);
+
+#endif /* AESD_REPLICA_H */
@@ -0,0 +1,487 @@
+/**
+ * @file aesd-ring.c
+ * @brief Thread safe, memory owning wrapper around the aesd circular buffer for user space
+ *
+ * Read offsets follow /dev/aesdchar: the stored entries are treated as one string, oldest first.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include "aesd-ring.h"
+
+/**
+ * Initializes @param ring to keep the latest @param capacity entries, at most
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int aesd_ring_init(struct aesd_ring *ring, unsigned int capacity, enum aesd_ring_mode mode)
+{
+    pthread_condattr_t attr;
+
+    if(capacity == 0 || capacity > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(ring, 0, sizeof(struct aesd_ring));
+    aesd_circular_buffer_init(&ring->buffer);
+    ring->capacity = capacity;
+    ring->mode = mode;
+    ring->next_seq = 1;
+    atomic_init(&ring->seq, 0);
+
+    if((errno = pthread_mutex_init(&ring->lock, NULL)) != 0)
+        return -1;
+
+    // aesd_ring_wait() deadlines must not move with the wall clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    errno = pthread_cond_init(&ring->appended, &attr);
+    pthread_condattr_destroy(&attr);
+    if(errno != 0)
+    {
+        pthread_mutex_destroy(&ring->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Frees all memory owned by @param ring.  No other thread may be using the ring.
+ */
+void aesd_ring_destroy(struct aesd_ring *ring)
+{
+    size_t i;
+
+    for(i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+        free(ring->slot[i].mem);
+
+    for(i = 0; i < ring->retired_count; i++)
+        free(ring->retired[i]);
+    free(ring->retired);
+
+    pthread_cond_destroy(&ring->appended);
+    pthread_mutex_destroy(&ring->lock);
+    memset(ring, 0, sizeof(struct aesd_ring));
+}
+
+/**
+ * Makes sure @param slot can hold @param size bytes.  Must be called with the ring lock held.
+ */
+static int aesd_ring_reserve_slot(struct aesd_ring *ring, struct aesd_ring_slot *slot, size_t size)
+{
+    char *mem;
+    char **retired;
+    size_t capacity;
+
+    if(slot->capacity >= size)
+        return 0;
+
+    // grow geometrically so a slot is replaced only a few times over the life of the ring
+    capacity = (slot->capacity * 2 > size) ? slot->capacity * 2 : size;
+
+    if(ring->mode == AESD_RING_MUTEX)
+    {
+        if((mem = realloc(slot->mem, capacity)) == NULL)
+            return -1;
+    }
+    else
+    {
+        if(slot->mem && ring->retired_count == ring->retired_capacity)
+        {
+            size_t retired_capacity = ring->retired_capacity ? ring->retired_capacity * 2 : 16;
+            if((retired = realloc(ring->retired, retired_capacity * sizeof(char *))) == NULL)
+                return -1;
+            ring->retired = retired;
+            ring->retired_capacity = retired_capacity;
+        }
+
+        if((mem = malloc(capacity)) == NULL)
+            return -1;
+
+        if(slot->mem)
+            ring->retired[ring->retired_count++] = slot->mem;
+    }
+
+    slot->mem = mem;
+    slot->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Copies @param data into @param ring as its newest entry numbered @param seq, or the next
+ * number when @param seq is 0.  Must be called with the ring lock held.
+ */
+static int aesd_ring_push(struct aesd_ring *ring, const char *data, size_t size, uint64_t seq)
+{
+    struct aesd_buffer_entry add_entry;
+    struct aesd_buffer_entry removed;
+    struct aesd_ring_slot *slot;
+    struct timespec now;
+    unsigned int seqcount;
+
+    if(seq != 0 && seq < ring->next_seq)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    slot = &ring->slot[ring->buffer.in_offs];
+    if(aesd_ring_reserve_slot(ring, slot, size) == -1)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    seqcount = atomic_load_explicit(&ring->seq, memory_order_relaxed);
+    atomic_store_explicit(&ring->seq, seqcount + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    // a ring smaller than the circular buffer evicts before the buffer itself is full
+    if(ring->count == ring->capacity && !ring->buffer.full)
+    {
+        aesd_circular_buffer_remove_entry(&ring->buffer, &removed);
+        ring->count--;
+    }
+
+    memcpy(slot->mem, data, size);
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    if(seq != 0)
+        ring->next_seq = seq;
+
+    add_entry.buffptr = slot->mem;
+    add_entry.size = size;
+    add_entry.seq = ring->next_seq++;
+    add_entry.timestamp_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+
+    if(!ring->buffer.full)
+        ring->count++;
+    aesd_circular_buffer_add_entry(&ring->buffer, &add_entry);
+
+    atomic_store_explicit(&ring->seq, seqcount + 2, memory_order_release);
+    pthread_cond_broadcast(&ring->appended);
+    return 0;
+}
+
+/**
+ * Copies the packet in @param data into @param ring as its newest entry, dropping the
+ * oldest entry when the ring is at capacity.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int aesd_ring_append(struct aesd_ring *ring, const char *data, size_t size)
+{
+    int retval;
+
+    pthread_mutex_lock(&ring->lock);
+    retval = aesd_ring_push(ring, data, size, 0);
+    pthread_mutex_unlock(&ring->lock);
+    return retval;
+}
+
+/**
+ * Like aesd_ring_append(), but numbers the entry @param seq instead of the next sequence
+ * number, as a replica does to keep the numbering of the ring it copies.  Numbers skipped
+ * over are never used.
+ * @return 0 on success, -1 with errno EEXIST if @param seq is below aesd_ring_next_seq()
+ */
+int aesd_ring_append_seq(struct aesd_ring *ring, const char *data, size_t size, uint64_t seq)
+{
+    int retval;
+
+    if(seq == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    retval = aesd_ring_push(ring, data, size, seq);
+    pthread_mutex_unlock(&ring->lock);
+    return retval;
+}
+
+/**
+ * @return the sequence number the next appended entry of @param ring will get
+ */
+uint64_t aesd_ring_next_seq(struct aesd_ring *ring)
+{
+    uint64_t seq;
+
+    pthread_mutex_lock(&ring->lock);
+    seq = ring->next_seq;
+    pthread_mutex_unlock(&ring->lock);
+    return seq;
+}
+
+/**
+ * Waits up to @param timeout_ms milliseconds for an entry numbered @param seq or later to
+ * be appended to @param ring.
+ * @return 0 once there is one, -1 with errno ETIMEDOUT otherwise
+ */
+int aesd_ring_wait(struct aesd_ring *ring, uint64_t seq, int timeout_ms)
+{
+    struct timespec deadline;
+    int retval = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    while(ring->next_seq <= seq && retval == 0)
+        retval = pthread_cond_timedwait(&ring->appended, &ring->lock, &deadline);
+    if(ring->next_seq > seq)
+        retval = 0;
+    pthread_mutex_unlock(&ring->lock);
+
+    if(retval != 0)
+    {
+        errno = retval;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Copies up to @param count bytes starting at @param offset of @param buffer into @param buf
+ */
+static size_t aesd_ring_copy(struct aesd_circular_buffer *buffer, size_t offset, char *buf, size_t count)
+{
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset = 0;
+    size_t read_size;
+    size_t copied = 0;
+
+    while(count > 0)
+    {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &entry_offset);
+        if(!entry)
+            break;
+
+        read_size = (count < entry->size - entry_offset) ? count : entry->size - entry_offset;
+        memcpy(buf, entry->buffptr + entry_offset, read_size);
+
+        buf += read_size;
+        count -= read_size;
+        offset += read_size;
+        copied += read_size;
+    }
+
+    return copied;
+}
+
+/**
+ * Takes a consistent copy of the ring's buffer without locking.
+ * @return the sequence count to validate the copy against with aesd_ring_read_retry()
+ */
+static unsigned int aesd_ring_read_begin(struct aesd_ring *ring, struct aesd_circular_buffer *snapshot)
+{
+    unsigned int seq;
+
+    for(;;)
+    {
+        seq = atomic_load_explicit(&ring->seq, memory_order_acquire);
+        if(seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(snapshot, &ring->buffer, sizeof(struct aesd_circular_buffer));
+        atomic_thread_fence(memory_order_acquire);
+
+        if(atomic_load_explicit(&ring->seq, memory_order_relaxed) == seq)
+            return seq;
+    }
+}
+
+static bool aesd_ring_read_retry(struct aesd_ring *ring, unsigned int seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&ring->seq, memory_order_relaxed) != seq;
+}
+
+/**
+ * Copies up to @param count bytes of history starting at @param offset into @param buf.
+ * @return the number of bytes copied, 0 at the end of the stored data
+ */
+ssize_t aesd_ring_read(struct aesd_ring *ring, size_t offset, char *buf, size_t count)
+{
+    struct aesd_circular_buffer snapshot;
+    unsigned int seq;
+    size_t copied;
+
+    if(ring->mode == AESD_RING_MUTEX)
+    {
+        pthread_mutex_lock(&ring->lock);
+        copied = aesd_ring_copy(&ring->buffer, offset, buf, count);
+        pthread_mutex_unlock(&ring->lock);
+        return copied;
+    }
+
+    // entry memory is never freed while the ring is live, so copying from a stale snapshot is safe
+    do
+    {
+        seq = aesd_ring_read_begin(ring, &snapshot);
+        copied = aesd_ring_copy(&snapshot, offset, buf, count);
+    } while(aesd_ring_read_retry(ring, seq));
+
+    return copied;
+}
+
+/**
+ * @return the oldest entry of @param buffer numbered @param seq or later, NULL if there is none
+ */
+static struct aesd_buffer_entry *aesd_ring_find_seq(struct aesd_circular_buffer *buffer, uint64_t seq)
+{
+    struct aesd_buffer_entry *entry;
+    uint32_t index = buffer->out_offs;
+    uint32_t i;
+
+    for(i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+    {
+        if(i > 0 && index == buffer->in_offs)
+            break;
+
+        entry = &buffer->entry[index];
+        if(!entry->buffptr)
+            break;
+        if(entry->seq >= seq)
+            return entry;
+
+        index = AESD_CIRCULAR_BUFFER_NEXT(index);
+    }
+
+    return NULL;
+}
+
+/**
+ * Copies the oldest stored entry numbered @param seq or later into @param buf, growing it
+ * and @param capacity with realloc() as needed, and sets @param entry_seq to its number.
+ * The number is larger than @param seq when the entries in between have been evicted.
+ * @return the size of the entry, or -1 with errno ENOENT if there is no such entry yet
+ */
+ssize_t aesd_ring_read_entry(struct aesd_ring *ring, uint64_t seq, char **buf, size_t *capacity,
+            uint64_t *entry_seq)
+{
+    struct aesd_circular_buffer snapshot;
+    struct aesd_circular_buffer *buffer = &snapshot;
+    struct aesd_buffer_entry *entry;
+    unsigned int seqcount = 0;
+    ssize_t size;
+    char *grown;
+
+    do
+    {
+        if(ring->mode == AESD_RING_MUTEX)
+        {
+            pthread_mutex_lock(&ring->lock);
+            buffer = &ring->buffer;
+        }
+        else
+        {
+            seqcount = aesd_ring_read_begin(ring, &snapshot);
+        }
+
+        size = -1;
+        errno = ENOENT;
+        entry = aesd_ring_find_seq(buffer, seq);
+        if(entry && entry->size > *capacity)
+        {
+            if((grown = realloc(*buf, entry->size)) == NULL)
+            {
+                errno = ENOMEM;
+                entry = NULL;
+            }
+            else
+            {
+                *buf = grown;
+                *capacity = entry->size;
+            }
+        }
+        if(entry)
+        {
+            memcpy(*buf, entry->buffptr, entry->size);
+            *entry_seq = entry->seq;
+            size = entry->size;
+        }
+
+        if(ring->mode == AESD_RING_MUTEX)
+        {
+            pthread_mutex_unlock(&ring->lock);
+            break;
+        }
+    } while(aesd_ring_read_retry(ring, seqcount));
+
+    return size;
+}
+
+/**
+ * Finds the read offset of byte @param write_cmd_offset within the zero referenced entry
+ * @param write_cmd, counted from the oldest stored entry like AESDCHAR_IOCSEEKTO.
+ * @return 0 with @param offset set, or -1 with errno EINVAL if there is no such byte
+ */
+int aesd_ring_offset_for_cmd(struct aesd_ring *ring, uint32_t write_cmd, uint32_t write_cmd_offset,
+            size_t *offset)
+{
+    struct aesd_circular_buffer snapshot;
+    struct aesd_circular_buffer *buffer = &snapshot;
+    struct aesd_buffer_entry *entry;
+    unsigned int seq = 0;
+    size_t pos;
+    uint32_t i;
+    int retval;
+
+    do
+    {
+        if(ring->mode == AESD_RING_MUTEX)
+        {
+            pthread_mutex_lock(&ring->lock);
+            buffer = &ring->buffer;
+        }
+        else
+        {
+            seq = aesd_ring_read_begin(ring, &snapshot);
+        }
+
+        retval = -1;
+        pos = 0;
+        for(i = 0; i <= write_cmd && i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+        {
+            entry = &buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+            if(!entry->buffptr)
+                break;
+
+            if(i < write_cmd)
+            {
+                pos += entry->size;
+            }
+            else if(write_cmd_offset < entry->size)
+            {
+                *offset = pos + write_cmd_offset;
+                retval = 0;
+            }
+        }
+
+        if(ring->mode == AESD_RING_MUTEX)
+        {
+            pthread_mutex_unlock(&ring->lock);
+            break;
+        }
+    } while(aesd_ring_read_retry(ring, seq));
+
+    if(retval == -1)
+        errno = EINVAL;
+    return retval;
+}
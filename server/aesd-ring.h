@@ -0,0 +1,91 @@
+/*
+ * aesd-ring.h
+ *
+ *  @brief User space bounded history ring built on the aesd-char-driver circular buffer.
+ *
+ *  The ring owns the memory of its entries and keeps the most recent capacity packets,
+ *  giving the same read semantics as /dev/aesdchar without the kernel module.
+ */
+
+#ifndef AESD_RING_H
+#define AESD_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+enum aesd_ring_mode
+{
+    /**
+     * Readers and writers all take the ring mutex
+     */
+    AESD_RING_MUTEX,
+    /**
+     * Writers take the ring mutex (uncontended with a single producer), readers never
+     * block and retry if a write raced with them.  Entry memory replaced by a larger block
+     * is kept until aesd_ring_destroy() so a racing reader never touches freed memory.
+     */
+    AESD_RING_SPMC,
+};
+
+struct aesd_ring_slot
+{
+    char *mem;
+    size_t capacity;
+};
+
+struct aesd_ring
+{
+    struct aesd_circular_buffer buffer;
+    /**
+     * Memory owned by each buffer entry, indexed like buffer.entry
+     */
+    struct aesd_ring_slot slot[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    unsigned int capacity;
+    unsigned int count;
+    enum aesd_ring_mode mode;
+    pthread_mutex_t lock;
+    /**
+     * Broadcast under lock after every append, for aesd_ring_wait()
+     */
+    pthread_cond_t appended;
+    /**
+     * Sequence count for AESD_RING_SPMC readers, odd while a write is in progress
+     */
+    atomic_uint seq;
+    /**
+     * Sequence number given to the next appended entry, starting at 1
+     */
+    uint64_t next_seq;
+    /**
+     * Blocks replaced in AESD_RING_SPMC mode, freed by aesd_ring_destroy()
+     */
+    char **retired;
+    size_t retired_count;
+    size_t retired_capacity;
+};
+
+extern int aesd_ring_init(struct aesd_ring *ring, unsigned int capacity, enum aesd_ring_mode mode);
+
+extern void aesd_ring_destroy(struct aesd_ring *ring);
+
+extern int aesd_ring_append(struct aesd_ring *ring, const char *data, size_t size);
+
+extern int aesd_ring_append_seq(struct aesd_ring *ring, const char *data, size_t size, uint64_t seq);
+
+extern uint64_t aesd_ring_next_seq(struct aesd_ring *ring);
+
+extern int aesd_ring_wait(struct aesd_ring *ring, uint64_t seq, int timeout_ms);
+
+extern ssize_t aesd_ring_read_entry(struct aesd_ring *ring, uint64_t seq, char **buf, size_t *capacity,
+            uint64_t *entry_seq);
+
+extern ssize_t aesd_ring_read(struct aesd_ring *ring, size_t offset, char *buf, size_t count);
+
+extern int aesd_ring_offset_for_cmd(struct aesd_ring *ring, uint32_t write_cmd, uint32_t write_cmd_offset,
+            size_t *offset);
+
+#endif /* AESD_RING_H */
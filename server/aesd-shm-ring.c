@@ -0,0 +1,390 @@
+/**
+ * @file aesd-shm-ring.c
+ * @brief Shared memory packet ring between local producers and aesdsocket
+ *
+ * Memory ordering: a producer fills its slots and then stores the commit word with release
+ * semantics, the consumer loads it with acquire before touching the slots and stores head
+ * with release once it is done with them, which producers load with acquire before reusing
+ * the slots.  The waiting flag and the commit words are ordered by full fences on both
+ * sides, so either the producer sees the consumer waiting or the consumer sees the packet.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "aesd-shm-ring.h"
+
+#define AESD_SHM_RING_MAGIC 0x61657364
+#define AESD_SHM_RING_VERSION 1
+#define AESD_SHM_RING_MIN_SLOTS 64
+
+// record flags
+#define AESD_SHM_RING_PAD 1
+
+struct aesd_shm_ring_record
+{
+    uint32_t size;
+    uint32_t flags;
+};
+
+#define AESD_SHM_RING_ALIGN(x) (((x) + AESD_SHM_RING_SLOT_SIZE - 1) & ~(size_t)(AESD_SHM_RING_SLOT_SIZE - 1))
+
+static size_t aesd_shm_ring_commit_offset(void)
+{
+    return AESD_SHM_RING_ALIGN(sizeof(struct aesd_shm_ring_header));
+}
+
+static size_t aesd_shm_ring_data_offset(uint64_t slots)
+{
+    return AESD_SHM_RING_ALIGN(aesd_shm_ring_commit_offset() + slots * sizeof(atomic_uint_fast64_t));
+}
+
+static size_t aesd_shm_ring_map_size(uint64_t slots)
+{
+    return aesd_shm_ring_data_offset(slots) + slots * AESD_SHM_RING_SLOT_SIZE;
+}
+
+static uint64_t aesd_shm_ring_record_slots(size_t size)
+{
+    return (sizeof(struct aesd_shm_ring_record) + size + AESD_SHM_RING_SLOT_SIZE - 1) / AESD_SHM_RING_SLOT_SIZE;
+}
+
+static void aesd_shm_ring_set_pointers(struct aesd_shm_ring *ring, void *map, uint64_t slots)
+{
+    ring->header = map;
+    ring->commit = (atomic_uint_fast64_t *)((char *)map + aesd_shm_ring_commit_offset());
+    ring->data = (char *)map + aesd_shm_ring_data_offset(slots);
+    ring->map_size = aesd_shm_ring_map_size(slots);
+    ring->mask = slots - 1;
+}
+
+/**
+ * Creates a ring of at most @param size bytes of packet slots, rounded down to a power of
+ * two number of slots, in a new memfd, with the eventfd that wakes its consumer.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int aesd_shm_ring_create(struct aesd_shm_ring *ring, size_t size)
+{
+    uint64_t slots = AESD_SHM_RING_MIN_SLOTS;
+    void *map;
+    uint64_t i;
+    int saved;
+
+    while(slots * 2 * AESD_SHM_RING_SLOT_SIZE <= size)
+        slots *= 2;
+
+    memset(ring, 0, sizeof(struct aesd_shm_ring));
+    ring->memfd = -1;
+    ring->eventfd = -1;
+
+    if((ring->memfd = memfd_create("aesd-shm-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1)
+        goto fail;
+    if(ftruncate(ring->memfd, aesd_shm_ring_map_size(slots)) == -1)
+        goto fail;
+    // producers get the memfd too, do not let them resize the mapping out from under us
+    if(fcntl(ring->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+        goto fail;
+    if((ring->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+        goto fail;
+
+    map = mmap(NULL, aesd_shm_ring_map_size(slots), PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+    if(map == MAP_FAILED)
+        goto fail;
+    aesd_shm_ring_set_pointers(ring, map, slots);
+
+    ring->header->magic = AESD_SHM_RING_MAGIC;
+    ring->header->version = AESD_SHM_RING_VERSION;
+    ring->header->slots = slots;
+    atomic_init(&ring->header->tail, 0);
+    atomic_init(&ring->header->head, 0);
+    atomic_init(&ring->header->waiting, 0);
+    for(i = 0; i < slots; i++)
+        atomic_init(&ring->commit[i], 0);
+
+    return 0;
+
+fail:
+    saved = errno;
+    if(ring->eventfd != -1)
+        close(ring->eventfd);
+    if(ring->memfd != -1)
+        close(ring->memfd);
+    errno = saved;
+    return -1;
+}
+
+/**
+ * Maps the ring in @param memfd as a producer, taking ownership of both descriptors.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int aesd_shm_ring_attach(struct aesd_shm_ring *ring, int memfd, int eventfd)
+{
+    struct aesd_shm_ring_header *header;
+    struct stat st;
+    uint64_t slots;
+    void *map;
+
+    memset(ring, 0, sizeof(struct aesd_shm_ring));
+    ring->memfd = memfd;
+    ring->eventfd = eventfd;
+
+    if(fstat(memfd, &st) == -1)
+        goto fail;
+    if((size_t)st.st_size < sizeof(struct aesd_shm_ring_header))
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if(map == MAP_FAILED)
+        goto fail;
+
+    header = map;
+    slots = header->slots;
+    if(header->magic != AESD_SHM_RING_MAGIC || header->version != AESD_SHM_RING_VERSION
+            || slots < AESD_SHM_RING_MIN_SLOTS || (slots & (slots - 1)) != 0
+            || aesd_shm_ring_map_size(slots) != (size_t)st.st_size)
+    {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        goto fail;
+    }
+
+    aesd_shm_ring_set_pointers(ring, map, slots);
+    return 0;
+
+fail:
+    close(memfd);
+    close(eventfd);
+    return -1;
+}
+
+/**
+ * Unmaps @param ring and closes its descriptors.
+ */
+void aesd_shm_ring_destroy(struct aesd_shm_ring *ring)
+{
+    if(ring->header)
+        munmap(ring->header, ring->map_size);
+    close(ring->memfd);
+    close(ring->eventfd);
+    memset(ring, 0, sizeof(struct aesd_shm_ring));
+}
+
+/**
+ * Passes the memfd and eventfd of @param ring to the producer connected on Unix socket @param fd.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int aesd_shm_ring_announce(struct aesd_shm_ring *ring, int fd)
+{
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    int fds[2] = { ring->memfd, ring->eventfd };
+
+    memset(control, 0, sizeof(control));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    return (sendmsg(fd, &msg, MSG_NOSIGNAL) == 1) ? 0 : -1;
+}
+
+/**
+ * Attaches to the ring announced on the Unix socket at @param path, as a producer.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int aesd_shm_ring_connect(struct aesd_shm_ring *ring, const char *path)
+{
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct sockaddr_un addr;
+    struct cmsghdr *cmsg;
+    int fds[2];
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1)
+    {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    return aesd_shm_ring_attach(ring, fds[0], fds[1]);
+}
+
+/**
+ * Copies the packet in @param data into @param ring and wakes the consumer if it is asleep.
+ * @return 0 on success, -1 with errno EAGAIN when the ring is full or EMSGSIZE when the
+ * packet can never fit
+ */
+int aesd_shm_ring_send(struct aesd_shm_ring *ring, const char *data, size_t size)
+{
+    struct aesd_shm_ring_header *header = ring->header;
+    struct aesd_shm_ring_record *record;
+    uint64_t slots = ring->mask + 1;
+    uint64_t needed = aesd_shm_ring_record_slots(size);
+    uint64_t pos, head, first, pad;
+
+    if(size > UINT32_MAX || needed > slots / 2)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    pos = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    do
+    {
+        first = pos & ring->mask;
+        pad = (first + needed > slots) ? slots - first : 0;
+        head = atomic_load_explicit(&header->head, memory_order_acquire);
+        if(pos + pad + needed - head > slots)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&header->tail, &pos, pos + pad + needed,
+                memory_order_relaxed, memory_order_relaxed));
+
+    if(pad)
+    {
+        record = (struct aesd_shm_ring_record *)(ring->data + first * AESD_SHM_RING_SLOT_SIZE);
+        record->size = 0;
+        record->flags = AESD_SHM_RING_PAD;
+        atomic_store_explicit(&ring->commit[first], pos + 1, memory_order_release);
+        pos += pad;
+        first = 0;
+    }
+
+    record = (struct aesd_shm_ring_record *)(ring->data + first * AESD_SHM_RING_SLOT_SIZE);
+    record->size = size;
+    record->flags = 0;
+    memcpy(record + 1, data, size);
+    atomic_store_explicit(&ring->commit[first], pos + 1, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&header->waiting, memory_order_relaxed)
+            && atomic_exchange_explicit(&header->waiting, 0, memory_order_relaxed))
+        eventfd_write(ring->eventfd, 1);
+
+    return 0;
+}
+
+/**
+ * Passes every published packet of @param ring, oldest first, to @param packet and frees
+ * its slots.  Only the consumer may call this.
+ * @return the number of packets drained
+ */
+size_t aesd_shm_ring_drain(struct aesd_shm_ring *ring, aesd_shm_ring_packet_fn packet, void *arg)
+{
+    struct aesd_shm_ring_header *header = ring->header;
+    volatile struct aesd_shm_ring_record *record;
+    uint64_t slots = ring->mask + 1;
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_relaxed);
+    uint64_t slot, used;
+    uint32_t size, flags;
+    size_t drained = 0;
+
+    while(atomic_load_explicit(&ring->commit[head & ring->mask], memory_order_acquire) == head + 1)
+    {
+        slot = head & ring->mask;
+        record = (volatile struct aesd_shm_ring_record *)(ring->data + slot * AESD_SHM_RING_SLOT_SIZE);
+
+        // producers share the mapping and can rewrite the header at any time, so it is read
+        // exactly once and only the copies are checked and used
+        size = record->size;
+        flags = record->flags;
+
+        // a size running off the end is skipped like padding
+        used = slots - slot;
+        if(!(flags & AESD_SHM_RING_PAD) && aesd_shm_ring_record_slots(size) <= used)
+        {
+            used = aesd_shm_ring_record_slots(size);
+            packet((const char *)(record + 1), size, arg);
+            drained++;
+        }
+
+        head += used;
+        atomic_store_explicit(&header->head, head, memory_order_release);
+    }
+
+    return drained;
+}
+
+/**
+ * Tells producers the consumer is about to sleep on the eventfd.
+ * @return true if the ring is still empty and the consumer may sleep, false if a packet
+ * was published in the meantime and it should drain again instead
+ */
+bool aesd_shm_ring_prepare_wait(struct aesd_shm_ring *ring)
+{
+    struct aesd_shm_ring_header *header = ring->header;
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_relaxed);
+
+    atomic_store_explicit(&header->waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if(atomic_load_explicit(&ring->commit[head & ring->mask], memory_order_acquire) == head + 1)
+    {
+        atomic_store_explicit(&header->waiting, 0, memory_order_relaxed);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Clears the wakeup after the consumer slept on the eventfd, whether or not it fired.
+ */
+void aesd_shm_ring_finish_wait(struct aesd_shm_ring *ring)
+{
+    eventfd_t value;
+
+    atomic_store_explicit(&ring->header->waiting, 0, memory_order_relaxed);
+    eventfd_read(ring->eventfd, &value);
+}
@@ -0,0 +1,86 @@
+/*
+ * aesd-shm-ring.h
+ *
+ *  @brief Multi producer, single consumer packet ring in shared memory.
+ *
+ *  The consumer creates the ring in a memfd together with an eventfd and hands both to
+ *  local producers over a Unix socket.  Producers copy packets straight into the mapping,
+ *  the consumer drains them in order without a system call per packet, and the eventfd is
+ *  written only when the consumer has gone to sleep on an empty ring.
+ *
+ *  The ring is an array of 64 byte slots.  A packet takes a run of consecutive slots
+ *  starting with an 8 byte header; a packet that would run past the end of the array is
+ *  preceded by a padding record so every packet is contiguous.  Producers claim slots with
+ *  a compare and swap on tail, and publish a record by storing its absolute position + 1
+ *  in the commit word of its first slot, so a word left over from an earlier lap never
+ *  looks committed.  A producer that dies between claiming and publishing stalls the ring.
+ */
+
+#ifndef AESD_SHM_RING_H
+#define AESD_SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define AESD_SHM_RING_SLOT_SIZE 64
+#define AESD_SHM_RING_DEFAULT_SIZE (4 * 1024 * 1024)
+// Unix socket producers look for the ring on by default, the path to pass to aesdsocket -S
+#define AESD_SHM_RING_DEFAULT_PATH "/var/tmp/aesdsocket-ingest"
+
+/**
+ * Start of the shared mapping, followed by the commit words and then the slots
+ */
+struct aesd_shm_ring_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t slots;
+    /**
+     * First slot not yet claimed by a producer
+     */
+    _Alignas(64) atomic_uint_fast64_t tail;
+    /**
+     * First slot not yet drained by the consumer
+     */
+    _Alignas(64) atomic_uint_fast64_t head;
+    /**
+     * Set by the consumer before it sleeps on the eventfd, cleared by the producer that wakes it
+     */
+    _Alignas(64) atomic_uint waiting;
+};
+
+struct aesd_shm_ring
+{
+    struct aesd_shm_ring_header *header;
+    atomic_uint_fast64_t *commit;
+    char *data;
+    size_t map_size;
+    uint64_t mask;
+    int memfd;
+    int eventfd;
+};
+
+typedef void (*aesd_shm_ring_packet_fn)(const char *data, size_t size, void *arg);
+
+extern int aesd_shm_ring_create(struct aesd_shm_ring *ring, size_t size);
+
+extern int aesd_shm_ring_attach(struct aesd_shm_ring *ring, int memfd, int eventfd);
+
+extern void aesd_shm_ring_destroy(struct aesd_shm_ring *ring);
+
+extern int aesd_shm_ring_announce(struct aesd_shm_ring *ring, int fd);
+
+extern int aesd_shm_ring_connect(struct aesd_shm_ring *ring, const char *path);
+
+extern int aesd_shm_ring_send(struct aesd_shm_ring *ring, const char *data, size_t size);
+
+extern size_t aesd_shm_ring_drain(struct aesd_shm_ring *ring, aesd_shm_ring_packet_fn packet, void *arg);
+
+extern bool aesd_shm_ring_prepare_wait(struct aesd_shm_ring *ring);
+
+extern void aesd_shm_ring_finish_wait(struct aesd_shm_ring *ring);
+
+#endif /* AESD_SHM_RING_H */
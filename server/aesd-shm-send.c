@@ -0,0 +1,178 @@
+/**
+ * @file aesd-shm-send.c
+ * @brief Local producer for aesdsocket's shared memory ingest ring
+ *
+ * aesd-shm-send [-s path] [-t port] [-n count] [-b bytes]
+ *   Without -n, sends every line of standard input as one packet, newline included.
+ *   With -n, sends count generated packets of bytes bytes each, newline included, and
+ *   prints the rate.  -s is the Unix socket aesdsocket -S announces the ring on.  -t sends
+ *   each packet over its own TCP connection to aesdsocket on port instead, the way remote
+ *   clients do, reading the history it answers with, for comparison.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "aesd-shm-ring.h"
+
+struct producer
+{
+    struct aesd_shm_ring ring;
+    const char *port;
+    char *response;
+    size_t response_size;
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int send_tcp(struct producer *producer, const char *data, size_t size)
+{
+    struct addrinfo hints, *info;
+    ssize_t len;
+    int fd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo("127.0.0.1", producer->port, &hints, &info) != 0)
+        return -1;
+
+    fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if(fd == -1 || connect(fd, info->ai_addr, info->ai_addrlen) == -1
+            || send(fd, data, size, MSG_NOSIGNAL) != (ssize_t)size)
+    {
+        if(fd != -1)
+            close(fd);
+        freeaddrinfo(info);
+        return -1;
+    }
+    freeaddrinfo(info);
+
+    // aesdsocket answers every packet with the whole history and then closes
+    while((len = recv(fd, producer->response, producer->response_size, 0)) > 0)
+        ;
+
+    close(fd);
+    return 0;
+}
+
+static int send_packet(struct producer *producer, const char *data, size_t size)
+{
+    if(producer->port)
+        return send_tcp(producer, data, size);
+
+    // the ring is full until aesdsocket catches up
+    while(aesd_shm_ring_send(&producer->ring, data, size) == -1)
+    {
+        if(errno != EAGAIN)
+            return -1;
+        sched_yield();
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct producer producer = { .port = NULL };
+    const char *path = AESD_SHM_RING_DEFAULT_PATH;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_len;
+    size_t count = 0;
+    size_t bytes = 64;
+    size_t i;
+    double start, seconds;
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:t:n:b:")) != -1)
+    {
+        switch(opt)
+        {
+            case 's':
+                path = optarg;
+                break;
+            case 't':
+                producer.port = optarg;
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                bytes = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                printf("usage: %s [-s path] [-t port] [-n count] [-b bytes]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if(producer.port)
+    {
+        producer.response_size = 65536;
+        if((producer.response = malloc(producer.response_size)) == NULL)
+        {
+            printf("malloc\n");
+            return 1;
+        }
+    }
+    else if(aesd_shm_ring_connect(&producer.ring, path) == -1)
+    {
+        printf("connect to ingest ring %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if(count == 0)
+    {
+        while((line_len = getline(&line, &line_capacity, stdin)) > 0)
+        {
+            if(send_packet(&producer, line, line_len) == -1)
+            {
+                printf("send packet: %s\n", strerror(errno));
+                return 1;
+            }
+        }
+    }
+    else
+    {
+        if(bytes == 0)
+            bytes = 1;
+        if((line = malloc(bytes)) == NULL)
+        {
+            printf("malloc\n");
+            return 1;
+        }
+        memset(line, 'x', bytes - 1);
+        line[bytes - 1] = '\n';
+
+        start = now_s();
+        for(i = 0; i < count; i++)
+        {
+            if(send_packet(&producer, line, bytes) == -1)
+            {
+                printf("send packet: %s\n", strerror(errno));
+                return 1;
+            }
+        }
+        seconds = now_s() - start;
+        printf("sent %zu packets of %zu bytes in %.3f s, %.0f packets/s\n", count, bytes, seconds,
+                seconds > 0 ? count / seconds : 0.0);
+    }
+
+    free(line);
+    free(producer.response);
+    if(!producer.port)
+        aesd_shm_ring_destroy(&producer.ring);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
@@ -14,11 +15,35 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesd-ring.h"
+#include "aesd-replica.h"
+#include "aesd-shm-ring.h"
+#include "aesd-history-cache.h"
+#include "../aesd-char-driver/aesd-framing.h"
+
+// keep the history in memory with aesd-ring instead of a file or the char device
+#ifndef USE_AESD_RING
+#define USE_AESD_RING 0
+#endif
 
 #ifndef USE_AESD_CHAR_DEVICE
+#if USE_AESD_RING
+#define USE_AESD_CHAR_DEVICE 0
+#else
 #define USE_AESD_CHAR_DEVICE 1
 #endif
+#endif
+
+// the file backend answers clients from an in-memory copy of the file while it fits under the cap,
+// the char device and the ring do not, entries they evict would make the copy diverge
+#define USE_HISTORY_CACHE (!USE_AESD_CHAR_DEVICE && !USE_AESD_RING)
 
 #define PORT "9000"
 #define BACKLOG 10
@@ -38,6 +63,212 @@
 volatile sig_atomic_t end_signal_caught = false;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+#if USE_AESD_RING
+struct aesd_ring history;
+// a follower serves reads from a copy of its leader's history and never appends itself
+struct aesd_replica replica;
+bool follower = false;
+#endif
+
+// with the char device the driver commits each packet atomically, only the file backend needs serialising
+static void storage_lock(void)
+{
+#if !USE_AESD_CHAR_DEVICE
+    pthread_mutex_lock(&mutex);
+#endif
+}
+
+static void storage_unlock(void)
+{
+#if !USE_AESD_CHAR_DEVICE
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+// packets written by local producers into shared memory, drained by drain_ingest
+struct aesd_shm_ring ingest;
+
+#if USE_HISTORY_CACHE
+struct aesd_history_cache history_cache;
+#endif
+
+// socket and scheduling settings, all off by default, -l turns on the low-latency profile
+#define LOW_LATENCY_BUSY_POLL_US 50
+
+struct tuning
+{
+    bool nodelay;
+    bool cork;
+    int busy_poll_us;
+    // -w: how long to retry a receive or accept that would block before sleeping in the kernel,
+    // only a win with a core to spare for every spinning thread
+    uint64_t spin_ns;
+    // -c: the accept loop runs on cpus[0], client threads round robin over the rest
+    int cpus[CPU_SETSIZE];
+    int ncpus;
+    int next_cpu;
+};
+
+struct tuning tuning;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Parses a CPU list like "2,4-7" into @param cpus.
+ * @return the number of CPUs, or -1 if @param list is malformed
+ */
+static int parse_cpus(const char *list, int *cpus)
+{
+    char *end;
+    long first, last;
+    int n = 0;
+
+    while(*list)
+    {
+        first = strtol(list, &end, 10);
+        last = first;
+        if(end == list)
+            return -1;
+        if(*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if(end == list)
+                return -1;
+        }
+        if(first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+
+        for(; first <= last && n < CPU_SETSIZE; first++)
+            cpus[n++] = first;
+
+        if(*end == ',')
+            end++;
+        else if(*end)
+            return -1;
+        list = end;
+    }
+
+    return n;
+}
+
+static void pin_attr(pthread_attr_t *attr, int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+// applied to every accepted client socket
+static void tune_socket(int fd)
+{
+    int yes = 1;
+
+    if(tuning.nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1)
+        syslog(LOG_WARNING, "TCP_NODELAY: %s", strerror(errno));
+
+#ifdef SO_BUSY_POLL
+    // raising the busy poll budget above net.core.busy_read needs CAP_NET_ADMIN
+    if(tuning.busy_poll_us && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &tuning.busy_poll_us,
+                sizeof(tuning.busy_poll_us)) == -1)
+    {
+        syslog(LOG_WARNING, "SO_BUSY_POLL: %s, continuing without it", strerror(errno));
+        tuning.busy_poll_us = 0;
+    }
+#endif
+}
+
+// hold partial frames back while a response goes out in several sends, flush them on uncork
+static void cork_socket(int fd, bool on)
+{
+    int value = on;
+
+    if(tuning.cork)
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
+static void spin_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// recv() that retries without blocking for tuning.spin_ns before it sleeps
+static ssize_t recv_client(int fd, char *buf, size_t len)
+{
+    uint64_t deadline;
+    ssize_t received;
+
+    if(tuning.spin_ns)
+    {
+        deadline = now_ns() + tuning.spin_ns;
+        do
+        {
+            received = recv(fd, buf, len, MSG_DONTWAIT);
+            if(received >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                return received;
+            spin_relax();
+        } while(now_ns() < deadline);
+    }
+
+    return recv(fd, buf, len, 0);
+}
+
+// accept() on the listening socket, non-blocking when spinning, the same way as recv_client
+static int accept_client(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+    uint64_t deadline;
+    int fd;
+
+    if(!tuning.spin_ns)
+        return accept(sockfd, addr, addrlen);
+
+    deadline = now_ns() + tuning.spin_ns;
+    do
+    {
+        if((fd = accept(sockfd, addr, addrlen)) != -1 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return fd;
+        spin_relax();
+    } while(now_ns() < deadline);
+
+    if(poll(&pfd, 1, -1) == -1)
+        return -1;
+    return accept(sockfd, addr, addrlen);
+}
+
+// mirror bytes just written to FILE_PATH into the history cache, with the storage lock held
+static void history_append(const char *data, ssize_t written)
+{
+#if USE_HISTORY_CACHE
+    if(written > 0)
+        aesd_history_cache_append(&history_cache, data, written);
+#endif
+}
+
+#if USE_HISTORY_CACHE
+static void send_all(int fd, const char *data, size_t size)
+{
+    ssize_t sent;
+
+    while(size > 0 && (sent = send(fd, data, size, MSG_NOSIGNAL)) > 0)
+    {
+        data += sent;
+        size -= sent;
+    }
+}
+#endif
+
 // thread args data struct
 struct thread_data
 {
@@ -90,6 +321,7 @@ void* fill_file(void* args)
     int threadfiled = 0;
     int threadreadlen = 0;
     int threadwritestatus = 0;
+    size_t packet_end;
 
 #if USE_AESD_CHAR_DEVICE
     int flags = O_RDWR | O_APPEND;
@@ -104,8 +336,8 @@ void* fill_file(void* args)
         exit(1);
     }
     
-    pthread_mutex_lock(&mutex);
-    while((threadreadlen = recv(thread_server_fd, threadbuf, sizeof(threadbuf), 0)) > 0)
+    storage_lock();
+    while((threadreadlen = recv_client(thread_server_fd, threadbuf, sizeof(threadbuf))) > 0)
     {
         if(strncmp(threadbuf, "AESDCHAR_IOCSEEKTO:", strlen("AESDCHAR_IOCSEEKTO:")) == 0)
         {
@@ -113,7 +345,7 @@ void* fill_file(void* args)
             char* separator = strchr(args, ',');
             if(!separator)
             {
-                pthread_mutex_unlock(&mutex); 
+                storage_unlock(); 
                 close(threadfiled);
                 close(thread_server_fd);
                 printf("malformed input\n");
@@ -129,10 +361,12 @@ void* fill_file(void* args)
 
             ioctl(threadfiled, AESDCHAR_IOCSEEKTO, &seekto);
 
+            cork_socket(thread_server_fd, true);
             while((threadreadlen = read(threadfiled, threadbuf, sizeof(threadbuf))) > 0)
                 send(thread_server_fd, threadbuf, threadreadlen, 0);
+            cork_socket(thread_server_fd, false);
 
-            pthread_mutex_unlock(&mutex); 
+            storage_unlock(); 
             close(threadfiled);
             close(thread_server_fd);
             syslog(LOG_INFO, "Closed connection from %s", thread_client_address);
@@ -145,24 +379,42 @@ void* fill_file(void* args)
         {
             close(thread_server_fd);
             printf("write to file\n");
-            pthread_mutex_unlock(&mutex); 
+            storage_unlock(); 
             exit(1);
         }
+        history_append(threadbuf, threadwritestatus);
 
-        if(memchr(threadbuf, '\n', threadreadlen) != NULL)
+        if(aesd_framing_find_ends(threadbuf, threadreadlen, &packet_end, 1) > 0)
         {
+#if USE_HISTORY_CACHE
+            struct aesd_history_view view;
+            if(aesd_history_cache_get(&history_cache, &view))
+            {
+                // the view stays valid without the lock, writers need not wait for this client
+                storage_unlock();
+                close(threadfiled);
+                send_all(thread_server_fd, view.data, view.size);
+                aesd_history_cache_put(&view);
+                close(thread_server_fd);
+                syslog(LOG_INFO, "Closed connection from %s", thread_client_address);
+                break;
+            }
+#endif
+
             close(threadfiled);
             if((threadfiled = open(FILE_PATH, O_RDONLY)) == -1)
             {
                 printf("reopen file for reading\n");
-                pthread_mutex_unlock(&mutex);
+                storage_unlock();
                 exit(1);
             }
 
+            cork_socket(thread_server_fd, true);
             while((threadreadlen = read(threadfiled, threadbuf, sizeof(threadbuf))) > 0)
                 send(thread_server_fd, threadbuf, threadreadlen, 0);
+            cork_socket(thread_server_fd, false);
 
-            pthread_mutex_unlock(&mutex); 
+            storage_unlock(); 
             close(threadfiled);
             close(thread_server_fd);
             syslog(LOG_INFO, "Closed connection from %s", thread_client_address);
@@ -173,6 +425,183 @@ void* fill_file(void* args)
     return NULL;
 }
 
+#if USE_AESD_RING
+// send the ring history from offset to the client
+static void send_history(int fd, size_t offset)
+{
+    char sendbuf[4096];
+    ssize_t len;
+
+    cork_socket(fd, true);
+    while((len = aesd_ring_read(&history, offset, sendbuf, sizeof(sendbuf))) > 0)
+    {
+        if(send(fd, sendbuf, len, 0) == -1)
+            break;
+        offset += len;
+    }
+    cork_socket(fd, false);
+}
+
+// same protocol as fill_file, with complete packets appended to the in-memory ring
+void* fill_ring(void* args)
+{
+    struct thread_data* thread_func_args = (struct thread_data *)args;
+    int thread_server_fd = (*thread_func_args).threadfd;
+    char threadbuf[512] = {0};
+    char *thread_client_address = (*thread_func_args).s;
+    char *packet = NULL;
+    size_t packet_len = 0;
+    size_t packet_cap = 0;
+    size_t ends[32];
+    size_t start, scanned, found, i;
+    int threadreadlen = 0;
+    bool committed = false;
+
+    while(!committed && (threadreadlen = recv_client(thread_server_fd, threadbuf, sizeof(threadbuf) - 1)) > 0)
+    {
+        if(packet_len == 0 && strncmp(threadbuf, "AESDCHAR_IOCSEEKTO:", strlen("AESDCHAR_IOCSEEKTO:")) == 0)
+        {
+            threadbuf[threadreadlen] = '\0';
+            char* args = threadbuf + strlen("AESDCHAR_IOCSEEKTO:");
+            char* separator = strchr(args, ',');
+            size_t offset = 0;
+            if(separator)
+            {
+                *separator = '\0';
+                if(aesd_ring_offset_for_cmd(&history, atoi(args), atoi(separator + 1), &offset) == 0)
+                    send_history(thread_server_fd, offset);
+            }
+            break;
+        }
+
+        if(packet_len + threadreadlen > packet_cap)
+        {
+            packet_cap = (packet_len + threadreadlen) * 2;
+            char *grown = realloc(packet, packet_cap);
+            if(!grown)
+            {
+                printf("packet realloc\n");
+                break;
+            }
+            packet = grown;
+        }
+        memcpy(packet + packet_len, threadbuf, threadreadlen);
+
+        // every newline in the new bytes ends a packet, anything after the last one is dropped with the connection
+        start = 0;
+        scanned = packet_len;
+        while((found = aesd_framing_find_ends(packet + scanned, packet_len + threadreadlen - scanned,
+                        ends, sizeof(ends) / sizeof(ends[0]))) > 0)
+        {
+            for(i = 0; i < found; i++)
+            {
+                if(!follower && aesd_ring_append(&history, packet + start, scanned + ends[i] - start) == -1)
+                    printf("ring append\n");
+                start = scanned + ends[i];
+            }
+            scanned = start;
+            committed = true;
+            if(found < sizeof(ends) / sizeof(ends[0]))
+                break;
+        }
+        packet_len += threadreadlen;
+
+        if(committed)
+            send_history(thread_server_fd, 0);
+    }
+
+    free(packet);
+    close(thread_server_fd);
+    syslog(LOG_INFO, "Closed connection from %s", thread_client_address);
+
+    return NULL;
+}
+#endif
+
+// where drain_ingest puts packets, the storage lock is taken lazily for the first packet of a batch
+struct ingest_target
+{
+    int filed;
+    bool locked;
+};
+
+static void ingest_packet(const char *data, size_t size, void *arg)
+{
+    struct ingest_target *target = arg;
+
+    if(!target->locked)
+    {
+        storage_lock();
+        target->locked = true;
+    }
+
+#if USE_AESD_RING
+    if(aesd_ring_append(&history, data, size) == -1)
+        printf("ring append\n");
+#else
+    ssize_t written;
+    if((written = write(target->filed, data, size)) == -1)
+        printf("write ingested packet\n");
+    history_append(data, written);
+#endif
+}
+
+// hands the ingest ring to producers connecting on the Unix socket and drains it into storage
+void* drain_ingest(void* args)
+{
+    int listenfd = *(int *)args;
+    struct ingest_target target = { .filed = -1, .locked = false };
+    struct pollfd pfds[2] = {
+        { .fd = listenfd, .events = POLLIN },
+        { .fd = ingest.eventfd, .events = POLLIN },
+    };
+    bool sleep;
+    int producerfd;
+
+#if !USE_AESD_RING
+#if USE_AESD_CHAR_DEVICE
+    int flags = O_WRONLY | O_APPEND;
+#else
+    int flags = O_WRONLY | O_APPEND | O_CREAT;
+#endif
+    if((target.filed = open(FILE_PATH, flags, 0666)) == -1)
+    {
+        printf("open file ingest thread\n");
+        exit(1);
+    }
+#endif
+
+    while(!end_signal_caught)
+    {
+        aesd_shm_ring_drain(&ingest, ingest_packet, &target);
+        if(target.locked)
+        {
+            storage_unlock();
+            target.locked = false;
+        }
+
+        // sleep on the eventfd only once producers know to write it
+        sleep = aesd_shm_ring_prepare_wait(&ingest);
+        poll(pfds, 2, sleep ? 500 : 0);
+        if(sleep)
+            aesd_shm_ring_finish_wait(&ingest);
+
+        if(pfds[0].revents & POLLIN)
+        {
+            if((producerfd = accept(listenfd, NULL, NULL)) != -1)
+            {
+                if(aesd_shm_ring_announce(&ingest, producerfd) == -1)
+                    printf("announce ingest ring\n");
+                close(producerfd);
+            }
+        }
+    }
+
+    if(target.filed != -1)
+        close(target.filed);
+    return NULL;
+}
+
 void* append_timestamp(void* timeargs)
 {
     int timerfiled = 0;
@@ -199,6 +628,12 @@ void* append_timestamp(void* timeargs)
             exit(1);
         }
 
+#if USE_AESD_RING
+        aesd_ring_append(&history, timestamp_str, len);
+        pthread_mutex_unlock(&mutex);
+        continue;
+#endif
+
         if((timerfiled = open(FILE_PATH, O_RDWR | O_APPEND | O_CREAT, 0666)) == -1)
         {
             printf("open file timer thread\n");
@@ -211,6 +646,7 @@ void* append_timestamp(void* timeargs)
             printf("write timestamp\n");
             exit(1);
         }
+        history_append(timestamp_str, timerwritestatus);
 
         close(timerfiled);
         pthread_mutex_unlock(&mutex);
@@ -244,6 +680,85 @@ int main(int argc, char *argv[])
     struct sockaddr_storage client_addr;
     socklen_t sin_size = sizeof(client_addr);
     char s[INET6_ADDRSTRLEN];
+    const char *port = PORT;
+    const char *lead_endpoint = NULL;
+    const char *follow_endpoint = NULL;
+    const char *ingest_path = NULL;
+    size_t cache_cap = AESD_HISTORY_CACHE_DEFAULT_CAP;
+    pthread_attr_t client_attr;
+    cpu_set_t accept_cpu;
+    struct sockaddr_un ingest_addr;
+    int ingestfd = -1;
+    pthread_t ingest_thread;
+    bool daemon_mode = false;
+    int opt;
+
+    // -p port to serve clients on, -L endpoint to stream the history to followers from,
+    // -F endpoint of the leader to follow, see aesd-replica.h for the endpoint format,
+    // -S Unix socket to hand the shared memory ingest ring to local producers on,
+    // -M bytes of history to keep in memory for the file backend, 0 to always read the file,
+    // -l low-latency profile: TCP_NODELAY, TCP_CORK around responses and SO_BUSY_POLL,
+    // -w microseconds to spin before blocking, -c CPUs to pin the accept loop and client threads to
+    while((opt = getopt(argc, argv, "dp:L:F:S:M:lw:c:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'd':
+                daemon_mode = true;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'L':
+                lead_endpoint = optarg;
+                break;
+            case 'F':
+                follow_endpoint = optarg;
+                break;
+            case 'S':
+                ingest_path = optarg;
+                break;
+            case 'M':
+                cache_cap = strtoull(optarg, NULL, 0);
+                break;
+            case 'l':
+                tuning.nodelay = true;
+                tuning.cork = true;
+                tuning.busy_poll_us = LOW_LATENCY_BUSY_POLL_US;
+                break;
+            case 'w':
+                tuning.spin_ns = strtoull(optarg, NULL, 0) * 1000;
+                break;
+            case 'c':
+                if((tuning.ncpus = parse_cpus(optarg, tuning.cpus)) <= 0)
+                {
+                    printf("bad CPU list %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                printf("usage: %s [-d] [-p port] [-L endpoint] [-F endpoint] [-S path] [-M bytes] [-l] [-w us] [-c cpus]\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+
+#if !USE_AESD_RING
+    if(lead_endpoint || follow_endpoint)
+    {
+        printf("replication needs the in-memory history, build with USE_AESD_RING=1\n");
+        exit(1);
+    }
+#endif
+#if !USE_HISTORY_CACHE
+    if(cache_cap != AESD_HISTORY_CACHE_DEFAULT_CAP)
+        printf("only the file backend keeps a history cache, ignoring -M\n");
+#endif
+    if(follow_endpoint && (lead_endpoint || ingest_path))
+    {
+        printf("a follower only takes packets from its leader\n");
+        exit(1);
+    }
 
     SLIST_HEAD(slisthead, slist_data_s) head;
     SLIST_INIT(&head);
@@ -254,7 +769,7 @@ int main(int argc, char *argv[])
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
-    if((addrstatus = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0)
+    if((addrstatus = getaddrinfo(NULL, port, &hints, &servinfo)) != 0)
     {
         printf("getaddrinfo\n");
         exit(-1);
@@ -300,28 +815,118 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    if(ingest_path)
+    {
+        memset(&ingest_addr, 0, sizeof(ingest_addr));
+        ingest_addr.sun_family = AF_UNIX;
+        if(strlen(ingest_path) >= sizeof(ingest_addr.sun_path))
+        {
+            printf("ingest socket path too long\n");
+            exit(1);
+        }
+        strcpy(ingest_addr.sun_path, ingest_path);
+        unlink(ingest_path);
+
+        if((ingestfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+                || bind(ingestfd, (struct sockaddr *)&ingest_addr, sizeof(ingest_addr)) == -1
+                || listen(ingestfd, BACKLOG) == -1)
+        {
+            printf("ingest socket\n");
+            exit(1);
+        }
+    }
+
     // fork after ensuring can bind on port
-    if(argc == 2)
+    if(daemon_mode)
+        make_daemon();
+
+#if USE_AESD_RING
+    if(aesd_ring_init(&history, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, AESD_RING_SPMC) == -1)
+    {
+        printf("ring init\n");
+        exit(1);
+    }
+
+    // replication threads start after make_daemon, a fork would leave them behind
+    follower = (follow_endpoint != NULL);
+    if(follower && aesd_replica_follow(&replica, &history, follow_endpoint) == -1)
+    {
+        printf("follow %s\n", follow_endpoint);
+        exit(1);
+    }
+    if(lead_endpoint && aesd_replica_lead(&replica, &history, lead_endpoint) == -1)
+    {
+        printf("lead on %s\n", lead_endpoint);
+        exit(1);
+    }
+#endif
+
+#if USE_HISTORY_CACHE
+    if(aesd_history_cache_init(&history_cache, cache_cap) == -1)
+    {
+        printf("history cache init\n");
+        exit(1);
+    }
+
+    // pick up whatever an earlier instance left in the file
+    int loadfd;
+    char loadbuf[4096];
+    ssize_t loadlen;
+    if((loadfd = open(FILE_PATH, O_RDONLY)) != -1)
     {
-        if (strcmp(argv[1], "-d") == 0)
-            make_daemon();       
+        while((loadlen = read(loadfd, loadbuf, sizeof(loadbuf))) > 0)
+            history_append(loadbuf, loadlen);
+        close(loadfd);
+    }
+#endif
+
+    if(ingest_path)
+    {
+        if(aesd_shm_ring_create(&ingest, AESD_SHM_RING_DEFAULT_SIZE) == -1)
+        {
+            printf("ingest ring\n");
+            exit(1);
+        }
+        pthread_create(&ingest_thread, NULL, drain_ingest, &ingestfd);
     }
 
 #if !USE_AESD_CHAR_DEVICE
-    // init timer thread
-    pthread_t *timer_thread = malloc(sizeof(pthread_t));
-    pthread_create(timer_thread, NULL, append_timestamp, NULL);
+    // init timer thread, a follower gets its leader's timestamps
+    pthread_t *timer_thread = NULL;
+#if USE_AESD_RING
+    if(!follower)
+#endif
+    {
+        timer_thread = malloc(sizeof(pthread_t));
+        pthread_create(timer_thread, NULL, append_timestamp, NULL);
+    }
 #endif
 
+    // accept_client() spins on a non-blocking accept
+    if(tuning.spin_ns)
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+    // only the accept loop and client threads are pinned, the background threads already exist
+    pthread_attr_init(&client_attr);
+    if(tuning.ncpus > 0)
+    {
+        CPU_ZERO(&accept_cpu);
+        CPU_SET(tuning.cpus[0], &accept_cpu);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(accept_cpu), &accept_cpu) != 0)
+            printf("pin accept loop to CPU %d\n", tuning.cpus[0]);
+    }
+
     // loop the process here until receive sigint or sigterm, then gracefully exit closing connections and deleting output file
     while(!end_signal_caught)
     {
         struct sockaddr* client_sock_addr = (struct sockaddr*)&client_addr;
-        if((newfd = accept(sockfd, client_sock_addr, &sin_size)) == -1)
+        if((newfd = accept_client(sockfd, client_sock_addr, &sin_size)) == -1)
         {
             printf("accept socket\n");
             continue;
         }
+        // accepted sockets do not inherit O_NONBLOCK on Linux
+        tune_socket(newfd);
 
         inet_ntop(client_addr.ss_family, get_in_addr(client_sock_addr), s, sizeof(s));
         syslog(LOG_INFO, "Accepted connection from %s", s);
@@ -335,8 +940,23 @@ int main(int argc, char *argv[])
         datap->args = arg_data;
         SLIST_INSERT_HEAD(&head, datap, entries);
 
-        pthread_create(datap->thread_id, NULL, fill_file, arg_data);
+        if(tuning.ncpus > 1)
+        {
+            pin_attr(&client_attr, tuning.cpus[1 + tuning.next_cpu]);
+            tuning.next_cpu = (tuning.next_cpu + 1) % (tuning.ncpus - 1);
+        }
+        else if(tuning.ncpus == 1)
+        {
+            pin_attr(&client_attr, tuning.cpus[0]);
+        }
+
+#if USE_AESD_RING
+        pthread_create(datap->thread_id, &client_attr, fill_ring, arg_data);
+#else
+        pthread_create(datap->thread_id, &client_attr, fill_file, arg_data);
+#endif
     }
+    pthread_attr_destroy(&client_attr);
     
     close(sockfd);
 
@@ -349,11 +969,29 @@ int main(int argc, char *argv[])
         free(datap);
     }
 
+    if(ingest_path)
+    {
+        pthread_join(ingest_thread, NULL);
+        aesd_shm_ring_destroy(&ingest);
+        close(ingestfd);
+        unlink(ingest_path);
+    }
+
 #if !USE_AESD_CHAR_DEVICE
-    pthread_cancel(*timer_thread);
-    pthread_join(*timer_thread, NULL);
-    free(timer_thread);
+    if(timer_thread)
+    {
+        pthread_cancel(*timer_thread);
+        pthread_join(*timer_thread, NULL);
+        free(timer_thread);
+    }
+#if USE_AESD_RING
+    if(follower || lead_endpoint)
+        aesd_replica_stop(&replica);
+    aesd_ring_destroy(&history);
+#else
     remove(FILE_PATH);
+    aesd_history_cache_destroy(&history_cache);
+#endif
 #endif
 
     pthread_mutex_destroy(&mutex);
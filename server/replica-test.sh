@@ -0,0 +1,125 @@
+#!/bin/bash
+# Runs a leader and two follower aesdsocket instances on this host and checks that the
+# followers serve the leader's history, including a follower started after the writes.
+# Usage: replica-test.sh [endpoint]
+# Build with "make USE_AESD_RING=1" in this directory first.  endpoint defaults to a Unix
+# socket, pass e.g. 127.0.0.1:9200 to replicate over TCP instead.
+
+set -e
+set -u
+cd `dirname $0`
+
+ENDPOINT=${1:-unix:/tmp/aesd-replica-test.sock}
+LEADER_PORT=9100
+FOLLOWER_PORTS="9101 9102"
+PIDS=""
+WORKDIR=$(mktemp -d)
+
+cleanup()
+{
+	for pid in $PIDS
+	do
+		kill $pid 2>/dev/null || true
+		wait $pid 2>/dev/null || true
+	done
+	rm -rf $WORKDIR
+}
+trap cleanup EXIT
+
+# send one line to the aesdsocket on port $1 and print the history it answers with
+request()
+{
+	exec 3<>/dev/tcp/127.0.0.1/$1
+	printf '%s\n' "$2" >&3
+	cat <&3
+	exec 3<&-
+}
+
+# save the history of the aesdsocket on port $1 to file $2 without writing to it, seeking to
+# the first byte of the oldest entry sends everything from there on and appends nothing
+history()
+{
+	exec 3<>/dev/tcp/127.0.0.1/$1
+	printf 'AESDCHAR_IOCSEEKTO:0,0\n' >&3
+	cat <&3 > $2
+	exec 3<&-
+}
+
+# wait until the aesdsocket on port $1 accepts connections
+wait_port()
+{
+	for i in $(seq 1 50)
+	do
+		if (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null
+		then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "nothing listening on port $1"
+	exit 1
+}
+
+# wait until the follower on port $1 holds exactly the leader's history, byte for byte
+wait_history()
+{
+	for i in $(seq 1 50)
+	do
+		history $LEADER_PORT $WORKDIR/leader
+		history $1 $WORKDIR/follower
+		if cmp -s $WORKDIR/leader $WORKDIR/follower
+		then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "failed: follower on port $1 holds"
+	cat $WORKDIR/follower
+	echo "instead of"
+	cat $WORKDIR/leader
+	exit 1
+}
+
+# the leader still holds every packet the test wrote, in order, timestamps aside
+check_leader()
+{
+	history $LEADER_PORT $WORKDIR/leader
+	grep '^packet ' $WORKDIR/leader > $WORKDIR/packets || true
+	printf 'packet %s\n' $(seq 1 $1) > $WORKDIR/expected
+	if ! cmp -s $WORKDIR/packets $WORKDIR/expected
+	then
+		echo "failed: leader holds"
+		cat $WORKDIR/leader
+		echo "instead of packet 1 to $1"
+		exit 1
+	fi
+}
+
+./aesdsocket -p $LEADER_PORT -L $ENDPOINT &
+PIDS="$PIDS $!"
+wait_port $LEADER_PORT
+
+set -- $FOLLOWER_PORTS
+./aesdsocket -p $1 -F $ENDPOINT &
+PIDS="$PIDS $!"
+wait_port $1
+
+for i in $(seq 1 5)
+do
+	request $LEADER_PORT "packet $i" > /dev/null
+done
+wait_history $1
+
+# a late follower catches up on everything the leader still holds
+./aesdsocket -p $2 -F $ENDPOINT &
+PIDS="$PIDS $!"
+wait_port $2
+wait_history $2
+
+# and both keep up with new writes
+request $LEADER_PORT "packet 6" > /dev/null
+wait_history $1
+wait_history $2
+check_leader 6
+
+echo "success"
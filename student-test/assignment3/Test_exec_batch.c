@@ -0,0 +1,85 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+/**
+ * stdout and stderr of every command are captured separately, in the order of the commands.
+ */
+void test_exec_batch_captures_output()
+{
+    char *const first[] = { "/bin/sh", "-c", "echo out1; echo err1 >&2", NULL };
+    char *const second[] = { "/bin/sh", "-c", "echo out2", NULL };
+    char *const *commands[] = { first, second };
+    struct exec_result results[2];
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_batch(commands, 2, 2, results), "both commands succeed");
+
+    TEST_ASSERT_TRUE(results[0].started);
+    TEST_ASSERT_EQUAL_STRING("out1\n", results[0].out);
+    TEST_ASSERT_EQUAL_STRING("err1\n", results[0].err);
+    TEST_ASSERT_EQUAL_STRING("out2\n", results[1].out);
+    TEST_ASSERT_NULL(results[1].err);
+
+    exec_result_free(&results[0]);
+    exec_result_free(&results[1]);
+}
+
+/**
+ * A command exiting with a non zero status fails the batch, its status is reported and the
+ * other commands still run.
+ */
+void test_exec_batch_reports_exit_status()
+{
+    char *const failing[] = { "/bin/sh", "-c", "echo partial; exit 3", NULL };
+    char *const passing[] = { "/bin/echo", "fine", NULL };
+    char *const *commands[] = { failing, passing };
+    struct exec_result results[2];
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_batch(commands, 2, 2, results), "a failing command fails the batch");
+
+    TEST_ASSERT_TRUE(results[0].started);
+    TEST_ASSERT_TRUE(WIFEXITED(results[0].status));
+    TEST_ASSERT_EQUAL_INT(3, WEXITSTATUS(results[0].status));
+    TEST_ASSERT_EQUAL_STRING("partial\n", results[0].out);
+
+    TEST_ASSERT_TRUE(results[1].started);
+    TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(results[1].status));
+    TEST_ASSERT_EQUAL_STRING("fine\n", results[1].out);
+
+    exec_result_free(&results[0]);
+    exec_result_free(&results[1]);
+}
+
+/**
+ * With fewer slots than commands, every command still runs and lands in its own result, and
+ * no more than max_parallel run at once: four 0.3 s commands two at a time take 0.6 s.
+ */
+void test_exec_batch_limits_parallelism()
+{
+    char *const zero[] = { "/bin/sh", "-c", "sleep 0.3; echo 0", NULL };
+    char *const one[] = { "/bin/sh", "-c", "sleep 0.3; echo 1", NULL };
+    char *const two[] = { "/bin/sh", "-c", "sleep 0.3; echo 2", NULL };
+    char *const three[] = { "/bin/sh", "-c", "sleep 0.3; echo 3", NULL };
+    char *const *commands[] = { zero, one, two, three };
+    const char *expected[] = { "0\n", "1\n", "2\n", "3\n" };
+    struct exec_result results[4];
+    struct timespec start, end;
+    double elapsed;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TEST_ASSERT_TRUE(do_exec_batch(commands, 4, 2, results));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (i = 0; i < 4; i++)
+    {
+        TEST_ASSERT_TRUE(results[i].started);
+        TEST_ASSERT_EQUAL_STRING(expected[i], results[i].out);
+        exec_result_free(&results[i]);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(elapsed >= 0.55, "more than max_parallel commands ran at once");
+}
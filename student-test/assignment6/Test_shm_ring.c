@@ -0,0 +1,71 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../server/aesd-shm-ring.h"
+
+struct drained
+{
+    size_t packets;
+    char last[64];
+    bool out_of_bounds;
+    const struct aesd_shm_ring *ring;
+};
+
+static void record_packet(const char *data, size_t size, void *arg)
+{
+    struct drained *drained = arg;
+    const char *end = drained->ring->data + (drained->ring->mask + 1) * AESD_SHM_RING_SLOT_SIZE;
+
+    drained->packets++;
+    if(data + size > end)
+        drained->out_of_bounds = true;
+    else if(size < sizeof(drained->last))
+        memcpy(drained->last, data, size);
+}
+
+/**
+ * Packets come out of the ring in order and complete.
+ */
+void test_shm_ring_drains_in_order()
+{
+    struct aesd_shm_ring ring;
+    struct drained drained = { .ring = &ring };
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_shm_ring_create(&ring, 4096), "create ring");
+    TEST_ASSERT_EQUAL_INT(0, aesd_shm_ring_send(&ring, "first\n", 6));
+    TEST_ASSERT_EQUAL_INT(0, aesd_shm_ring_send(&ring, "second\n", 7));
+
+    TEST_ASSERT_EQUAL_UINT(2, aesd_shm_ring_drain(&ring, record_packet, &drained));
+    TEST_ASSERT_EQUAL_STRING_LEN("second\n", drained.last, 7);
+    TEST_ASSERT_FALSE(drained.out_of_bounds);
+
+    aesd_shm_ring_destroy(&ring);
+}
+
+/**
+ * A producer shares the mapping with the consumer and can grow the size of a record after
+ * publishing it.  The consumer has to skip such a record like padding instead of reading
+ * past the end of the ring.
+ */
+void test_shm_ring_skips_size_grown_after_publish()
+{
+    struct aesd_shm_ring ring;
+    struct drained drained = { .ring = &ring };
+    uint32_t size = UINT32_MAX - 64;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_shm_ring_create(&ring, 4096), "create ring");
+    TEST_ASSERT_EQUAL_INT(0, aesd_shm_ring_send(&ring, "packet\n", 7));
+
+    // every record starts with its 32 bit size, the first one in slot 0
+    memcpy(ring.data, &size, sizeof(size));
+
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(0, aesd_shm_ring_drain(&ring, record_packet, &drained),
+            "a record running off the end of the ring was delivered");
+    TEST_ASSERT_EQUAL_UINT(0, drained.packets);
+    TEST_ASSERT_FALSE(drained.out_of_bounds);
+    // padding takes every slot up to the end of the array
+    TEST_ASSERT_EQUAL_UINT64(ring.mask + 1, atomic_load(&ring.header->head));
+
+    aesd_shm_ring_destroy(&ring);
+}
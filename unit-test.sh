@@ -11,3 +11,7 @@ make clean
 make
 cd ..
 ./build/assignment-autotest/assignment-autotest
+rc=$?
+# Performance regression tests against bench/perf-baseline.csv, see bench/perf-test.sh
+make -C build perf-test || rc=1
+exit ${rc}